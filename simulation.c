@@ -4,17 +4,34 @@
  * @brief The main function of the program.
  *
  * Initializes terrain parameters, calls functions to generate a heightmap and
- * simulate terrain erosion.
+ * simulate terrain erosion. With an argument, runs the sweep described by
+ * that spec file instead (see sweep_spec_load()), or with --bench-exp2,
+ * compares the fast exp2 kernels with libm (see benchmark_fast_exp2()), or
+ * with --check-residuals, checks the residual frames (see check_residual_frames()).
  *
+ * @param argc Number of arguments.
+ * @param argv Arguments, argv[1] the optional sweep spec, --bench-exp2 or --check-residuals.
  * @return int Exit status.
  */
-int main()
+int main(int argc, char **argv)
 {
+    int bench_exp2 = argc > 1 && strcmp(argv[1], "--bench-exp2") == 0;
+    int check_residuals = argc > 1 && strcmp(argv[1], "--check-residuals") == 0;
+    if (argc > 1 && !bench_exp2 && !check_residuals)
+    {
+        struct sweep_spec spec;
+        if (sweep_spec_load(&spec, argv[1]) != 0)
+            return 1;
+        int status = run_sweep_spec(&spec);
+        sweep_spec_free(&spec);
+        return status == 0 ? 0 : 1;
+    }
+
     // Define the size of the terrain
     int width = 512;  // Width of the terrain
     int height = 512; // Height of the terrain
 
-    random_init(); // Initialize random number generator
+    unsigned int terrain_seed = TERRAIN_SEED_DEFAULT; // Seed of the terrain, the same one on every run
 
     // Create the heightmap (2D matrix)
     double heightmap[width][height];
@@ -25,13 +42,24 @@ int main()
     vec2 width_range = {5.0, 20.0};     // Range of width for bosses (min, max)
     vec2 amplitude_range = {1.0, 15.0}; // Range of amplitude for bosses (min, max)
 
+    // Compare the fast exp2 kernels with libm
+    if (bench_exp2)
+    {
+        benchmark_fast_exp2(width, height, num_bosses, scale, width_range, amplitude_range, terrain_seed);
+        return 0;
+    }
+
+    // Decode residual frames back to complete ones
+    if (check_residuals)
+        return check_residual_frames(width, height, num_bosses, scale, width_range, amplitude_range, terrain_seed) == 0 ? 0 : 1;
+
     // Call the erosion simulation with parameter variations
-    erosion_simulation_with_param_variations("./image", width, height, num_bosses, scale, width_range, amplitude_range);
+    erosion_simulation_with_param_variations("./image", width, height, num_bosses, scale, width_range, amplitude_range, terrain_seed);
 
     // // Générer le terrain aléatoire
-    // generate_random_heightgaussian( width, height, heightmap,num_bosses, scale, width_range, amplitude_range);
+    // generate_random_heightgaussian( width, height, heightmap,num_bosses, scale, width_range, amplitude_range, terrain_seed);
 
-    // save_heightmap_as_image(width, height, heightmap, "generate_random_heightgaussian.png");
+    // save_heightmap_as_image(width, height, heightmap, "generate_random_heightgaussian.png", NULL);
 
     // struct parameters p = {
     //     0.1, // inertia
@@ -46,11 +74,101 @@ int main()
 
     // simulate_erosion(height,width,heightmap, p, 100000);
 
-    // save_heightmap_as_image(width, height, heightmap, "result.png");
+    // struct run_options gray16 = {.format = IMAGE_GRAY16, .profile = PNG_ARCHIVAL};
+    // save_heightmap_as_image(width, height, heightmap, "result.png", &gray16);
+
+    // // Lossless snapshot, reloaded without any conversion by load_heightmap()
+    // struct run_options raw = {.format = RAW_F64, .profile = PNG_ARCHIVAL};
+    // save_heightmap_as_image(width, height, heightmap, "result.hmap", &raw);
+
+    // // Erode an existing terrain instead of a generated one
+    // struct heightmap_file dem;
+    // if (load_heightmap("dem.pgm", 0, 0, &dem) == 0)
+    // {
+    //     simulate_erosion(dem.height, dem.width, (double(*)[dem.height])dem.data, p, 100000);
+    //     unload_heightmap(&dem);
+    // }
 
     return 0;
 }
 
+/**
+ * @brief Returns the time elapsed since an arbitrary fixed point.
+ *
+ * @return double Monotonic time in seconds.
+ */
+static double get_time()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+/**
+ * @brief Returns the number of threads to use for parallel work.
+ *
+ * @return int Number of online processors, at least 1.
+ */
+static int get_nb_threads()
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+}
+
+struct row_band {
+    void (*fn)(void *ctx, int begin, int end); /**< Work applied to rows [begin, end). */
+    void *ctx;                                 /**< Context shared by all bands. */
+    int begin;                                 /**< First row of the band. */
+    int end;                                   /**< Row after the last row of the band. */
+};
+
+/**
+ * @brief Thread entry point running one band of parallel_rows().
+ */
+static void *row_band_main(void *arg)
+{
+    struct row_band *band = (struct row_band *)arg;
+    band->fn(band->ctx, band->begin, band->end);
+    return NULL;
+}
+
+/**
+ * @brief Splits rows [0, rows) into one band per thread and processes them in parallel.
+ *
+ * The calling thread processes the first band itself. If a thread cannot be
+ * created its band is processed by the calling thread instead.
+ *
+ * @param rows Number of rows.
+ * @param fn Work applied to rows [begin, end).
+ * @param ctx Context passed to fn.
+ */
+static void parallel_rows(int rows, void (*fn)(void *ctx, int begin, int end), void *ctx)
+{
+    int nb_threads = MIN(get_nb_threads(), MAX(rows, 1));
+    struct row_band bands[nb_threads];
+    pthread_t threads[nb_threads];
+    int started[nb_threads];
+
+    for (int t = 0; t < nb_threads; ++t)
+    {
+        bands[t].fn = fn;
+        bands[t].ctx = ctx;
+        bands[t].begin = (int)((long)rows * t / nb_threads);
+        bands[t].end = (int)((long)rows * (t + 1) / nb_threads);
+        started[t] = t > 0 && pthread_create(&threads[t], NULL, row_band_main, &bands[t]) == 0;
+    }
+    for (int t = 0; t < nb_threads; ++t)
+    {
+        if (!started[t])
+            fn(ctx, bands[t].begin, bands[t].end);
+    }
+    for (int t = 1; t < nb_threads; ++t)
+    {
+        if (started[t])
+            pthread_join(threads[t], NULL);
+    }
+}
+
 /**
  * @brief Creates directories recursively if they do not exist.
  *
@@ -67,7 +185,7 @@ int create_directories(const char *path)
     while ((p = strchr(p, '/')) != NULL)
     {
         *p = '\0'; // Temporarily terminate the string
-        if (mkdir(temp, 0755) != 0 && errno != EEXIST)
+        if (p != temp && mkdir(temp, 0755) != 0 && errno != EEXIST) // the root of an absolute path exists
         {
             return -1; // Error creating directory
         }
@@ -83,739 +201,6225 @@ int create_directories(const char *path)
     return 0; // Success
 }
 
+struct directory_cache {
+    char **paths;         /**< Directories created or found by this process. */
+    int count;            /**< Number of directories. */
+    int capacity;         /**< Allocated entries. */
+    pthread_mutex_t lock; /**< Protects the cache, shared by the snapshot writer threads. */
+};
+
+static struct directory_cache directory_cache = {NULL, 0, 0, PTHREAD_MUTEX_INITIALIZER};
+
 /**
- * @brief Saves the heightmap as an image file.
+ * @brief Creates the directories containing a file, once per process.
  *
- * @param width Width of the heightmap.
- * @param height Height of the heightmap.
- * @param heightmap 2D array representing the heightmap.
- * @param filename Name of the output image file.
+ * A sweep saves thousands of snapshots in a few run directories: once a
+ * directory has been created, it is remembered and the following files in
+ * it cost no mkdir() at all. Directories removed by someone else during the
+ * run are not created again, the file write then fails.
+ *
+ * @param filename Name of the file.
+ * @return int 0 if successful, -1 if there is an error.
  */
-void save_heightmap_as_image(int width, int height, double heightmap[width][height], const char *filename)
+static int create_parent_directories(const char *filename)
 {
-    // Create the necessary directories
-    char dir_path[1024];
-    snprintf(dir_path, sizeof(dir_path), "%s", filename);
+    const char *last_slash = strrchr(filename, '/');
+    if (last_slash == NULL || last_slash == filename)
+        return 0;
+    size_t len = last_slash - filename;
 
-    // Remove the last part after the final '/'
-    char *last_slash = strrchr(dir_path, '/');
-    if (last_slash != NULL)
+    int result = 0;
+    pthread_mutex_lock(&directory_cache.lock);
+    for (int i = directory_cache.count - 1; i >= 0; --i)
     {
-        *last_slash = '\0'; // Terminate before the file name
-        if (create_directories(dir_path) != 0)
+        if (strncmp(directory_cache.paths[i], filename, len) == 0 && directory_cache.paths[i][len] == '\0')
         {
-            printf("Error creating directories for: %s\n", dir_path);
-            return;
+            pthread_mutex_unlock(&directory_cache.lock);
+            return 0;
         }
     }
 
-    // Create an integer array for the image (in RGBA format)
-    unsigned char *image = (unsigned char *)malloc(width * height * 3 * sizeof(unsigned char));
-    if (image == NULL)
+    // Remove the last part after the final '/'
+    char dir_path[1024];
+    snprintf(dir_path, sizeof(dir_path), "%.*s", (int)len, filename);
+    if (create_directories(dir_path) != 0)
     {
-        printf("Memory allocation error for the image.\n");
-        return;
+        printf("Error creating directories for: %s\n", dir_path);
+        result = -1;
     }
-
-    // Normalize the heightmap to values between 0 and 255 and store in the image array
-    for (int y = 0; y < height; y++)
+    else
     {
-        for (int x = 0; x < width; x++)
+        if (directory_cache.count == directory_cache.capacity)
         {
-            // Normalize and convert to RGB values
-            unsigned char value = (unsigned char)heightmap[y][x];
-            int idx = (y * width + x) * 3; // Index for the image in RGB format
-            image[idx] = value;            // R
-            image[idx + 1] = value;        // G
-            image[idx + 2] = value;        // B
+            int capacity = MAX(2 * directory_cache.capacity, 16);
+            char **paths = (char **)realloc(directory_cache.paths, capacity * sizeof(char *));
+            if (paths != NULL)
+            {
+                directory_cache.paths = paths;
+                directory_cache.capacity = capacity;
+            }
         }
+        char *path = directory_cache.count < directory_cache.capacity ? strdup(dir_path) : NULL;
+        if (path != NULL)
+            directory_cache.paths[directory_cache.count++] = path;
     }
+    pthread_mutex_unlock(&directory_cache.lock);
+    return result;
+}
 
-    // Save the image as PNG
-    int result = stbi_write_png(filename, width, height, 3, image, width * 3);
-    if (result)
-    {
-        printf("Image successfully saved as: %s\n", filename);
-    }
-    else
+/**
+ * @brief Updates an Adler-32 checksum with more data.
+ *
+ * @param adler Checksum of the previous data, 1 for no data.
+ * @param data Data to add.
+ * @param len Length of the data.
+ * @return uint32_t Updated checksum.
+ */
+static uint32_t adler32_update(uint32_t adler, const unsigned char *data, size_t len)
+{
+    uint32_t s1 = adler & 0xffff;
+    uint32_t s2 = adler >> 16;
+    while (len > 0)
     {
-        printf("Error saving the image.\n");
+        // 5552 is the largest block that cannot overflow s2 before the modulo
+        size_t block = MIN(len, (size_t)5552);
+        for (size_t i = 0; i < block; ++i)
+        {
+            s1 += data[i];
+            s2 += s1;
+        }
+        s1 %= 65521;
+        s2 %= 65521;
+        data += block;
+        len -= block;
     }
-
-    // Free memory
-    free(image);
+    return s2 << 16 | s1;
 }
 
 /**
- * @brief Initializes the random number generator using the current time.
+ * @brief Combines the Adler-32 checksums of two consecutive pieces of data.
+ *
+ * @param adler1 Checksum of the first piece.
+ * @param adler2 Checksum of the second piece.
+ * @param len2 Length of the second piece.
+ * @return uint32_t Checksum of the concatenation.
  */
-void random_init()
+static uint32_t adler32_combine(uint32_t adler1, uint32_t adler2, size_t len2)
 {
-    srand(time(NULL)); // Initialize random seed with current time
+    uint32_t rem = (uint32_t)(len2 % 65521);
+    uint32_t s1 = adler1 & 0xffff;
+    uint32_t s2 = (uint32_t)(((uint64_t)rem * s1) % 65521);
+    s1 += (adler2 & 0xffff) + 65521 - 1;
+    s2 += (adler1 >> 16) + (adler2 >> 16) + 65521 - rem;
+    s1 %= 65521;
+    s2 %= 65521;
+    return s2 << 16 | s1;
 }
 
 /**
- * @brief PCG hash function for generating a pseudo-random value.
+ * @brief Multiplies a 32 x 32 matrix over GF(2) by a vector, see crc32_combine().
  *
- * @param input Input value to hash.
- * @return uint32_t Pseudo-random hash.
+ * @param matrix Columns of the matrix.
+ * @param vector The vector.
+ * @return uint32_t The product.
  */
-static uint32_t PCG_Hash(uint32_t input)
+static uint32_t gf2_matrix_times(const uint32_t *matrix, uint32_t vector)
 {
-    uint32_t state = input * 747796405u + 2891336453u;
-    uint32_t word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
-    return (word >> 22u) ^ word;
+    uint32_t sum = 0;
+    for (; vector != 0; vector >>= 1, ++matrix)
+    {
+        if (vector & 1)
+            sum ^= *matrix;
+    }
+    return sum;
 }
 
 /**
- * @brief Generates a random double between 0 and 1.
+ * @brief Combines the CRC-32 checksums of two consecutive pieces of data.
  *
- * @param seed Seed for random number generation.
- * @return double Random double in the range [0, 1].
+ * Appending len2 zero bytes to the first piece is a linear operator on its
+ * CRC: the operator for one zero bit is squared up to len2 bytes, as zlib's
+ * crc32_combine() does.
+ *
+ * @param crc1 Checksum of the first piece.
+ * @param crc2 Checksum of the second piece.
+ * @param len2 Length of the second piece.
+ * @return uint32_t Checksum of the concatenation.
  */
-double random_double(unsigned int seed)
+static uint32_t crc32_combine(uint32_t crc1, uint32_t crc2, uint64_t len2)
 {
-    // Hash the seed
-    uint32_t hash = PCG_Hash((uint32_t)seed);
+    uint32_t even[32], odd[32]; // operators for 2^k zero bits
+    if (len2 == 0)
+        return crc1;
+    odd[0] = 0xedb88320u; // reflected CRC-32 polynomial
+    for (int n = 1; n < 32; ++n)
+        odd[n] = 1u << (n - 1);
+    for (int n = 0; n < 32; ++n)
+        even[n] = gf2_matrix_times(odd, odd[n]); // 2 zero bits
+    for (int n = 0; n < 32; ++n)
+        odd[n] = gf2_matrix_times(even, even[n]); // 4 zero bits
 
-    // Normalize to [0, 1]
-    return (double)hash / (double)UINT32_MAX;
+    // apply the operator of each set bit of len2, starting with one zero byte
+    uint32_t *square = even, *base = odd;
+    while (len2 != 0)
+    {
+        for (int n = 0; n < 32; ++n)
+            square[n] = gf2_matrix_times(base, base[n]);
+        if (len2 & 1)
+            crc1 = gf2_matrix_times(square, crc1);
+        len2 >>= 1;
+        uint32_t *swap = square;
+        square = base;
+        base = swap;
+    }
+    return crc1 ^ crc2;
 }
 
 /**
- * @brief Generates a random double within a specified range [min, max].
+ * @brief Compresses data into raw deflate blocks with stb's fixed Huffman encoder.
  *
- * @param seed Seed for random number generation.
- * @param min Minimum value of the range.
- * @param max Maximum value of the range.
- * @return double Random double in the range [min, max].
+ * Same matching as stbi_zlib_compress(), without the zlib header and
+ * checksum. A block that is not the last one ends with an empty stored block
+ * (a sync flush), which brings the stream back to a byte boundary, so the
+ * outputs of consecutive pieces can be concatenated into a single stream.
+ *
+ * quality follows stbi_compress_level from 5 up. Below 5, matching is greedy
+ * (no lazy matching) with hash chains of quality entries, and 0 stores the
+ * data without compression.
+ *
+ * @param data Data to compress.
+ * @param data_len Length of the data.
+ * @param quality Length of the hash chains, 0 for stored blocks.
+ * @param last 1 if this piece ends the stream.
+ * @param out_len Length of the compressed data.
+ * @return unsigned char* Compressed data (stb stretchy buffer, free with stbiw__sbfree()), NULL on error.
  */
-double random_double_min_max(unsigned int seed, double min, double max)
+static unsigned char *deflate_piece(unsigned char *data, int data_len, int quality, int last, int *out_len)
 {
-    // Normalize to [0.0, 1.0]
-    double normalized = random_double(seed);
-    // Scale to [min, max]
-    return min + normalized * (max - min);
+    static unsigned short lengthc[] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258, 259};
+    static unsigned char lengtheb[] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+    static unsigned short distc[] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577, 32768};
+    static unsigned char disteb[] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+    unsigned int bitbuf = 0;
+    int i, j, bitcount = 0;
+    unsigned char *out = NULL;
+    unsigned char ***hash_table = (unsigned char ***)STBIW_MALLOC(stbiw__ZHASH * sizeof(unsigned char **));
+    if (hash_table == NULL)
+        return NULL;
+    int lazy = quality >= 5;
+
+    stbiw__zlib_add(last, 1); // BFINAL
+    stbiw__zlib_add(1, 2);    // BTYPE = 1 -- fixed huffman
+
+    for (i = 0; i < stbiw__ZHASH; ++i)
+        hash_table[i] = NULL;
+
+    i = quality > 0 ? 0 : data_len;
+    while (i < data_len - 3)
+    {
+        // hash next 3 bytes of data to be compressed
+        int h = stbiw__zhash(data + i) & (stbiw__ZHASH - 1), best = 3;
+        unsigned char *bestloc = 0;
+        unsigned char **hlist = hash_table[h];
+        int n = stbiw__sbcount(hlist);
+        for (j = 0; j < n; ++j)
+        {
+            if (hlist[j] - data > i - 32768)
+            { // if entry lies within window
+                int d = stbiw__zlib_countm(hlist[j], data + i, data_len - i);
+                if (d >= best)
+                {
+                    best = d;
+                    bestloc = hlist[j];
+                }
+            }
+        }
+        // when hash table entry is too long, delete half the entries
+        if (hash_table[h] && stbiw__sbn(hash_table[h]) == 2 * quality)
+        {
+            STBIW_MEMMOVE(hash_table[h], hash_table[h] + quality, sizeof(hash_table[h][0]) * quality);
+            stbiw__sbn(hash_table[h]) = quality;
+        }
+        stbiw__sbpush(hash_table[h], data + i);
+
+        if (bestloc && lazy)
+        {
+            // "lazy matching" - check match at *next* byte, and if it's better, do cur byte as literal
+            h = stbiw__zhash(data + i + 1) & (stbiw__ZHASH - 1);
+            hlist = hash_table[h];
+            n = stbiw__sbcount(hlist);
+            for (j = 0; j < n; ++j)
+            {
+                if (hlist[j] - data > i - 32767)
+                {
+                    int e = stbiw__zlib_countm(hlist[j], data + i + 1, data_len - i - 1);
+                    if (e > best)
+                    { // if next match is better, bail on current match
+                        bestloc = NULL;
+                        break;
+                    }
+                }
+            }
+        }
+
+        if (bestloc)
+        {
+            int d = (int)(data + i - bestloc); // distance back
+            for (j = 0; best > lengthc[j + 1] - 1; ++j)
+                ;
+            stbiw__zlib_huff(j + 257);
+            if (lengtheb[j])
+                stbiw__zlib_add(best - lengthc[j], lengtheb[j]);
+            for (j = 0; d > distc[j + 1] - 1; ++j)
+                ;
+            stbiw__zlib_add(stbiw__zlib_bitrev(j, 5), 5);
+            if (disteb[j])
+                stbiw__zlib_add(d - distc[j], disteb[j]);
+            i += best;
+        }
+        else
+        {
+            stbiw__zlib_huffb(data[i]);
+            ++i;
+        }
+    }
+    // write out final bytes
+    for (; i < data_len; ++i)
+        stbiw__zlib_huffb(data[i]);
+    stbiw__zlib_huff(256); // end of block
+    if (!last)
+    {
+        // sync flush: empty stored block, BFINAL = 0, BTYPE = 0
+        stbiw__zlib_add(0, 3);
+    }
+    // pad with 0 bits to byte boundary
+    while (bitcount)
+        stbiw__zlib_add(0, 1);
+    if (!last)
+    {
+        stbiw__sbpush(out, 0x00); // LEN
+        stbiw__sbpush(out, 0x00);
+        stbiw__sbpush(out, 0xff); // NLEN
+        stbiw__sbpush(out, 0xff);
+    }
+
+    for (i = 0; i < stbiw__ZHASH; ++i)
+        (void)stbiw__sbfree(hash_table[i]);
+    STBIW_FREE(hash_table);
+
+    // store uncompressed if asked to or if compression was worse
+    if (quality <= 0 || stbiw__sbn(out) > data_len + ((data_len + 32766) / 32767) * 5)
+    {
+        stbiw__sbn(out) = 0;
+        j = 0;
+        do
+        {
+            int blocklen = MIN(data_len - j, 32767);
+            stbiw__sbpush(out, last && data_len - j == blocklen); // BFINAL = ?, BTYPE = 0 -- no compression
+            stbiw__sbpush(out, STBIW_UCHAR(blocklen));             // LEN
+            stbiw__sbpush(out, STBIW_UCHAR(blocklen >> 8));
+            stbiw__sbpush(out, STBIW_UCHAR(~blocklen)); // NLEN
+            stbiw__sbpush(out, STBIW_UCHAR(~blocklen >> 8));
+            stbiw__sbmaybegrow(out, blocklen);
+            memcpy(out + stbiw__sbn(out), data + j, blocklen);
+            stbiw__sbn(out) += blocklen;
+            j += blocklen;
+        } while (j < data_len);
+    }
+
+    *out_len = stbiw__sbn(out);
+    return out;
 }
 
+struct inflate_state {
+    const unsigned char *in; /**< Compressed data. */
+    size_t in_size;          /**< Size of the compressed data. */
+    size_t in_pos;           /**< Next byte to read. */
+    uint32_t bitbuf;         /**< Bits read but not consumed yet, least significant first. */
+    int bitcount;            /**< Number of bits in bitbuf. */
+    unsigned char *out;      /**< Decompressed data. */
+    size_t out_size;         /**< Size of the decompressed data. */
+    size_t out_pos;          /**< Next byte to write. */
+};
+
+struct inflate_huffman {
+    short counts[16];   /**< Number of codes of each length. */
+    short symbols[288]; /**< Symbols in canonical code order. */
+};
+
 /**
- * @brief Generates a random 2D vector with components between 0 and the given dimensions.
+ * @brief Reads bits of a deflate stream, least significant first.
  *
- * @param width Width of the area.
- * @param height Height of the area.
- * @return vec2 Randomly generated 2D vector.
+ * @param s The stream.
+ * @param need Number of bits, up to 16.
+ * @return int The bits, -1 past the end of the data.
  */
-vec2 random_vec2(int width, int height)
+static int inflate_bits(struct inflate_state *s, int need)
 {
-    vec2 rdm;
-    rdm.x = random_double_min_max(rand(), 0, width);
-    rdm.y = random_double_min_max(rand(), 0, height);
-    return rdm;
-};
+    while (s->bitcount < need)
+    {
+        if (s->in_pos == s->in_size)
+            return -1;
+        s->bitbuf |= (uint32_t)s->in[s->in_pos++] << s->bitcount;
+        s->bitcount += 8;
+    }
+    int value = (int)(s->bitbuf & ((1u << need) - 1));
+    s->bitbuf >>= need;
+    s->bitcount -= need;
+    return value;
+}
 
 /**
- * @brief Computes the gradient at a given position on the heightmap.
+ * @brief Builds a canonical Huffman code from the lengths of its codes.
  *
- * @param w Width of the heightmap.
- * @param h Heightmap.
- * @param pos Position (vec2) to compute the gradient at.
- * @return vec2 Gradient vector at the given position.
+ * @param h The code to build.
+ * @param lengths Length of the code of each symbol, 0 for unused symbols.
+ * @param n Number of symbols.
+ * @return int 1 if successful, 0 if the lengths describe too many codes.
  */
-vec2 compute_gradient_central(int w, double *h, vec2 pos)
+static int inflate_build(struct inflate_huffman *h, const unsigned char *lengths, int n)
 {
-    int x = (int)pos.x;
-    int y = (int)pos.y;
-
-    if (x < 1 || x >= w - 1 || y < 1 || y >= w - 1)
-        return (vec2){0.0, 0.0};
-
-    vec2 gradient;
-    gradient.x = (H(h, w, x + 1, y) - H(h, w, x - 1, y)) * 0.5;
-    gradient.y = (H(h, w, x, y + 1) - H(h, w, x, y - 1)) * 0.5;
-
-    return gradient;
+    short offsets[16];
+    memset(h->counts, 0, sizeof(h->counts));
+    for (int i = 0; i < n; ++i)
+        h->counts[lengths[i]]++;
+    int left = 1;
+    for (int len = 1; len < 16; ++len)
+    {
+        left = left * 2 - h->counts[len];
+        if (left < 0)
+            return 0;
+    }
+    offsets[1] = 0;
+    for (int len = 1; len < 15; ++len)
+        offsets[len + 1] = offsets[len] + h->counts[len];
+    for (int i = 0; i < n; ++i)
+    {
+        if (lengths[i] != 0)
+            h->symbols[offsets[lengths[i]]++] = (short)i;
+    }
+    return 1;
 }
 
 /**
- * @brief Computes the gradient at a given position on the heightmap.
+ * @brief Decodes a symbol with a canonical Huffman code, one bit at a time.
  *
- * @param w Width of the heightmap.
- * @param h Heightmap.
- * @param pos Position (vec2) to compute the gradient at.
- * @return vec2 Gradient vector at the given position.
+ * @param s The stream.
+ * @param h The code.
+ * @return int The symbol, -1 if the data ends or the code is invalid.
  */
-vec2 compute_gradient(int w, double *h, vec2 pos)
+static int inflate_symbol(struct inflate_state *s, const struct inflate_huffman *h)
 {
-    int x = (int)pos.x;
-    int y = (int)pos.y;
-    double u = 0.5;
-    double v = 0.5;
-    vec2 gradient;
-    gradient.x = (H(h, w, x + 1, y) - H(h, w, x, y)) * (1.0 - v) +
-                 (H(h, w, x + 1, y + 1) - H(h, w, x, y + 1)) * v;
-    gradient.y = (H(h, w, x, y + 1) - H(h, w, x, y)) * (1.0 - u) +
-                 (H(h, w, x + 1, y + 1) - H(h, w, x + 1, y)) * u;
-    return gradient;
+    int code = 0, first = 0, index = 0;
+    for (int len = 1; len < 16; ++len)
+    {
+        int bit = inflate_bits(s, 1);
+        if (bit < 0)
+            return -1;
+        code |= bit;
+        int count = h->counts[len];
+        if (code - first < count)
+            return h->symbols[index + code - first];
+        index += count;
+        first = (first + count) << 1;
+        code <<= 1;
+    }
+    return -1;
 }
 
 /**
- * @brief Verifies if a drop's position is within the valid heightmap boundaries.
+ * @brief Decodes the literals and matches of a compressed block.
  *
- * @param drop The drop object.
- * @param width Width of the heightmap.
- * @param height Height of the heightmap.
- * @return int 1 if the position is valid, 0 otherwise.
+ * @param s The stream.
+ * @param lengths Code of the literals, lengths and end of block.
+ * @param distances Code of the distances.
+ * @return int 1 at the end of the block, 0 if the data is invalid.
  */
-int verify_drop_pos(struct drop drop, int width, int height)
+static int inflate_codes(struct inflate_state *s, const struct inflate_huffman *lengths, const struct inflate_huffman *distances)
 {
-    int x = (int)drop.position.x;
-    int y = (int)drop.position.y;
-    return 0 < x && x < width - 1 && 0 < y && y < height - 1;
+    static const short length_base[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+    static const short length_extra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+    static const short distance_base[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+    static const short distance_extra[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+    while (1)
+    {
+        int symbol = inflate_symbol(s, lengths);
+        if (symbol < 0 || symbol > 285)
+            return 0;
+        if (symbol == 256)
+            return 1;
+        if (symbol < 256)
+        {
+            if (s->out_pos == s->out_size)
+                return 0;
+            s->out[s->out_pos++] = (unsigned char)symbol;
+            continue;
+        }
+        int extra = inflate_bits(s, length_extra[symbol - 257]);
+        int code = inflate_symbol(s, distances);
+        if (extra < 0 || code < 0 || code > 29)
+            return 0;
+        size_t length = (size_t)(length_base[symbol - 257] + extra);
+        extra = inflate_bits(s, distance_extra[code]);
+        if (extra < 0)
+            return 0;
+        size_t distance = (size_t)(distance_base[code] + extra);
+        if (distance > s->out_pos || length > s->out_size - s->out_pos)
+            return 0;
+        // byte by byte: a match may overlap the bytes it produces
+        for (size_t i = 0; i < length; ++i, ++s->out_pos)
+            s->out[s->out_pos] = s->out[s->out_pos - distance];
+    }
 }
 
 /**
- * @brief Simulates sediment deposition for a drop at a given position.
+ * @brief Reads the code lengths of a dynamic block and builds its codes.
  *
- * @param width Width of the heightmap.
- * @param height Height of the heightmap.
- * @param heightmap 2D heightmap array.
- * @param pos Position of the drop (vec2).
- * @param to_drop Amount of sediment to deposit.
- * @return double Amount of sediment actually deposited.
+ * @param s The stream.
+ * @param lengths Set to the code of the literals, lengths and end of block.
+ * @param distances Set to the code of the distances.
+ * @return int 1 if successful, 0 if the data is invalid.
  */
-double simulate_deposition(int width, int height, double heightmap[width][height], vec2 pos, double to_drop)
+static int inflate_dynamic_codes(struct inflate_state *s, struct inflate_huffman *lengths, struct inflate_huffman *distances)
 {
-    int x1 = (int)pos.x;
-    int y1 = (int)pos.y;
-
-    int x2 = MIN(x1 + 1, width - 1);
-    int y2 = MIN(y1 + 1, height - 1);
-
-    double dx = pos.x - x1;
-    double dy = pos.y - y1;
-
-    double w11 = (1.0 - dx) * (1.0 - dy); // Weight for (x1, y1)
-    double w12 = (1.0 - dx) * dy;         // Weight for (x1, y2)
-    double w21 = dx * (1.0 - dy);         // Weight for (x2, y1)
-    double w22 = dx * dy;                 // Weight for (x2, y2)
-
-    double sum_w = w11 + w12 + w21 + w22;
-    if (sum_w <= EPSILON)
-        return 0.0;
-
-    w11 /= sum_w;
-    w12 /= sum_w;
-    w21 /= sum_w;
-    w22 /= sum_w;
+    static const unsigned char order[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+    unsigned char code_lengths[286 + 30];
+    struct inflate_huffman lencode;
+    int nb_lengths = inflate_bits(s, 5) + 257;
+    int nb_distances = inflate_bits(s, 5) + 1;
+    int nb_codes = inflate_bits(s, 4) + 4;
+    if (nb_lengths < 257 || nb_lengths > 286 || nb_distances < 1 || nb_distances > 30 || nb_codes < 4)
+        return 0;
 
-    double sum_dropped = 0.0;
-    double dropped;
-    if (to_drop * w11 > 0.0)
+    memset(code_lengths, 0, sizeof(code_lengths));
+    for (int i = 0; i < nb_codes; ++i)
     {
-        dropped = to_drop * w11;
-        H(*heightmap, width, x1, y1) += dropped;
-        sum_dropped += dropped;
+        int len = inflate_bits(s, 3);
+        if (len < 0)
+            return 0;
+        code_lengths[order[i]] = (unsigned char)len;
     }
-    if (to_drop * w12 > 0.0)
+    if (!inflate_build(&lencode, code_lengths, 19))
+        return 0;
+
+    // 16 repeats the previous length, 17 and 18 repeat zeros
+    int n = 0;
+    memset(code_lengths, 0, sizeof(code_lengths));
+    while (n < nb_lengths + nb_distances)
     {
-        dropped = to_drop * w12;
-        H(*heightmap, width, x1, y2) += dropped;
-        sum_dropped += dropped;
+        int symbol = inflate_symbol(s, &lencode);
+        if (symbol < 0)
+            return 0;
+        if (symbol < 16)
+        {
+            code_lengths[n++] = (unsigned char)symbol;
+            continue;
+        }
+        int len = 0, repeat;
+        if (symbol == 16)
+        {
+            if (n == 0)
+                return 0;
+            len = code_lengths[n - 1];
+            repeat = 3 + inflate_bits(s, 2);
+        }
+        else
+            repeat = symbol == 17 ? 3 + inflate_bits(s, 3) : 11 + inflate_bits(s, 7);
+        if (repeat < 3 || n + repeat > nb_lengths + nb_distances)
+            return 0;
+        while (repeat-- > 0)
+            code_lengths[n++] = (unsigned char)len;
     }
-    if (to_drop * w21 > 0.0)
+    return code_lengths[256] != 0 && inflate_build(lengths, code_lengths, nb_lengths) && inflate_build(distances, code_lengths + nb_lengths, nb_distances);
+}
+
+/**
+ * @brief Decompresses raw deflate blocks, the inverse of deflate_piece().
+ *
+ * The output size must be known: it is the size of a PNG image with its
+ * filter bytes, or of the runs of a residual frame.
+ *
+ * @param in Compressed data.
+ * @param in_size Size of the compressed data.
+ * @param out Decompressed data.
+ * @param out_size Size of the decompressed data.
+ * @return int 1 if the blocks decode to exactly out_size bytes, 0 otherwise.
+ */
+static int inflate_raw(const unsigned char *in, size_t in_size, unsigned char *out, size_t out_size)
+{
+    struct inflate_state s = {in, in_size, 0, 0, 0, out, out_size, 0};
+    struct inflate_huffman lengths, distances;
+    int last = 0;
+    while (!last)
     {
-        dropped = to_drop * w21;
-        H(*heightmap, width, x2, y1) += dropped;
-        sum_dropped += dropped;
+        last = inflate_bits(&s, 1);
+        int type = inflate_bits(&s, 2);
+        if (last < 0 || type < 0 || type == 3)
+            return 0;
+        if (type == 0)
+        {
+            // stored block: byte aligned length and its complement, then the bytes
+            s.bitbuf = 0;
+            s.bitcount = 0;
+            if (s.in_size - s.in_pos < 4)
+                return 0;
+            size_t len = (size_t)(s.in[s.in_pos] | s.in[s.in_pos + 1] << 8);
+            if ((size_t)(s.in[s.in_pos + 2] | s.in[s.in_pos + 3] << 8) != (~len & 0xffff) || s.in_size - s.in_pos - 4 < len || s.out_size - s.out_pos < len)
+                return 0;
+            memcpy(s.out + s.out_pos, s.in + s.in_pos + 4, len);
+            s.in_pos += 4 + len;
+            s.out_pos += len;
+            continue;
+        }
+        if (type == 1)
+        {
+            unsigned char fixed[288 + 30];
+            memset(fixed, 8, 144);
+            memset(fixed + 144, 9, 112);
+            memset(fixed + 256, 7, 24);
+            memset(fixed + 280, 8, 8);
+            memset(fixed + 288, 5, 30);
+            inflate_build(&lengths, fixed, 288);
+            inflate_build(&distances, fixed + 288, 30);
+        }
+        else if (!inflate_dynamic_codes(&s, &lengths, &distances))
+            return 0;
+        if (!inflate_codes(&s, &lengths, &distances))
+            return 0;
     }
-    if (to_drop * w22 > 0.0)
+    return s.out_pos == s.out_size;
+}
+
+struct png_band {
+    const unsigned char *pixels; /**< First row of the image. */
+    int stride;                  /**< Bytes between two rows of pixels. */
+    int width;                   /**< Width of the image in pixels. */
+    int height;                  /**< Height of the image in pixels. */
+    int bpp;                     /**< Bytes per pixel. */
+    int begin;                   /**< First row of the band. */
+    int end;                     /**< Row after the last row of the band. */
+    int last;                    /**< 1 for the band ending the image. */
+    int filter;                  /**< PNG filter of every row, -1 to pick the best one per row. */
+    int quality;                 /**< Deflate quality, see deflate_piece(). */
+    uint32_t sequence;           /**< APNG sequence number of an fdAT chunk, 0 for an IDAT chunk. */
+    unsigned char *chunk;        /**< Complete IDAT chunk holding the compressed band. */
+    int chunk_len;               /**< Length of the chunk, 0 on error. */
+    uint32_t adler;              /**< Adler-32 of the filtered band. */
+    long filtered_len;           /**< Length of the filtered band. */
+};
+
+/**
+ * @brief Filters and compresses bands [begin, end) of a PNG image into IDAT chunks.
+ *
+ * Rows are filtered with the band's fixed filter or, like stb does, with the
+ * filter giving the smallest sum of absolute values. A band only reads the row
+ * above its first row, never the output of another band.
+ */
+static void encode_png_bands(void *arg, int begin, int end)
+{
+    struct png_band *bands = (struct png_band *)arg;
+    for (int b = begin; b < end; ++b)
     {
-        dropped = to_drop * w22;
-        H(*heightmap, width, x2, y2) += dropped;
-        sum_dropped += dropped;
+        struct png_band *band = &bands[b];
+        int row_bytes = band->width * band->bpp;
+        band->chunk_len = 0;
+        band->filtered_len = (long)(row_bytes + 1) * (band->end - band->begin);
+        unsigned char *filt = (unsigned char *)malloc(band->filtered_len);
+        signed char *line_buffer = (signed char *)malloc(row_bytes);
+        if (filt == NULL || line_buffer == NULL)
+        {
+            free(filt);
+            free(line_buffer);
+            continue;
+        }
+
+        for (int y = band->begin; y < band->end; ++y)
+        {
+            int best_filter = band->filter, best_filter_val = 0x7fffffff;
+            for (int filter_type = 0; filter_type < 5 && band->filter < 0; filter_type++)
+            {
+                stbiw__encode_png_line((unsigned char *)band->pixels, band->stride, band->width, band->height, y, band->bpp, filter_type, line_buffer);
+
+                // Estimate the entropy of the line using this filter; the less, the better.
+                int est = 0;
+                for (int i = 0; i < row_bytes; ++i)
+                    est += abs((signed char)line_buffer[i]);
+                if (est < best_filter_val)
+                {
+                    best_filter_val = est;
+                    best_filter = filter_type;
+                }
+            }
+            if (best_filter != 4 || band->filter >= 0) // the last filter tried is still in line_buffer
+                stbiw__encode_png_line((unsigned char *)band->pixels, band->stride, band->width, band->height, y, band->bpp, best_filter, line_buffer);
+
+            unsigned char *row = filt + (long)(y - band->begin) * (row_bytes + 1);
+            row[0] = (unsigned char)best_filter;
+            memcpy(row + 1, line_buffer, row_bytes);
+        }
+        free(line_buffer);
+
+        band->adler = adler32_update(1, filt, band->filtered_len);
+        int deflated_len;
+        unsigned char *deflated = deflate_piece(filt, (int)band->filtered_len, band->quality, band->last, &deflated_len);
+        free(filt);
+        if (deflated == NULL)
+            continue;
+
+        // length, tag, data and CRC of the IDAT chunk, fdAT data starts with its sequence number
+        int sequence_len = band->sequence != 0 ? 4 : 0;
+        band->chunk = (unsigned char *)malloc(deflated_len + sequence_len + 12);
+        if (band->chunk != NULL)
+        {
+            unsigned char *o = band->chunk;
+            stbiw__wp32(o, deflated_len + sequence_len);
+            stbiw__wptag(o, (sequence_len ? "fdAT" : "IDAT"));
+            if (sequence_len)
+                stbiw__wp32(o, band->sequence);
+            memcpy(o, deflated, deflated_len);
+            o += deflated_len;
+            stbiw__wpcrc(&o, deflated_len + sequence_len);
+            band->chunk_len = deflated_len + sequence_len + 12;
+        }
+        stbiw__sbfree(deflated);
     }
+}
 
-    return sum_dropped;
+/**
+ * @brief Writes one chunk holding a small piece of the zlib stream, IDAT or fdAT.
+ *
+ * @param f Stream receiving the chunk.
+ * @param data Data of the chunk.
+ * @param len Length of the data, at most 8 bytes.
+ * @param sequence NULL for an IDAT chunk, the next APNG sequence number for an fdAT chunk.
+ * @return int 1 if successful, 0 otherwise.
+ */
+static int write_png_data_chunk(FILE *f, const unsigned char *data, int len, uint32_t *sequence)
+{
+    unsigned char chunk[12 + 4 + 8];
+    unsigned char *o = chunk;
+    int sequence_len = sequence != NULL ? 4 : 0;
+    stbiw__wp32(o, len + sequence_len);
+    stbiw__wptag(o, (sequence != NULL ? "fdAT" : "IDAT"));
+    if (sequence != NULL)
+    {
+        stbiw__wp32(o, *sequence); // the macro evaluates its argument 4 times
+        ++*sequence;
+    }
+    memcpy(o, data, len);
+    o += len;
+    stbiw__wpcrc(&o, len + sequence_len);
+    return fwrite(chunk, 1, o - chunk, f) == (size_t)(o - chunk);
 }
 
 /**
- * @brief Simulates a single erosion event by dropping particles on the terrain.
+ * @brief Writes the image data of a PNG, filtering and compressing bands of rows in parallel.
  *
- * @param width Width of the heightmap.
- * @param height Height of the heightmap.
- * @param heightmap 2D heightmap array.
- * @param drop The drop object (particle).
- * @param capacity Maximum sediment capacity of the terrain.
- * @param inertia Inertia factor of sediment.
- * @param slope Slope factor affecting sediment deposition.
- * @param gravity Gravity force.
- * @param evaporation Evaporation rate of sediment.
- * @return double Amount of sediment deposited.
+ * The image is cut into bands of about PNG_BAND_BYTES. Each band is filtered
+ * and deflated by its own thread into independent blocks ending with a sync
+ * flush, and stored in its own IDAT chunk, so the CRCs are computed in
+ * parallel too. The zlib header and the Adler-32 of the whole stream,
+ * combined from the band checksums, go in two small IDAT chunks around them.
+ * The band count only depends on the image size, so the output does not
+ * depend on the number of threads. APNG frames get the same chunks as fdAT.
+ *
+ * @param f Stream receiving the chunks.
+ * @param pixels First row of the image.
+ * @param stride Bytes between two rows, larger than a row for a rectangle of a bigger image.
+ * @param width Width of the image.
+ * @param height Height of the image.
+ * @param bpp Bytes per pixel.
+ * @param filter PNG filter of every row, -1 to pick the best one per row.
+ * @param quality Deflate quality, see deflate_piece().
+ * @param sequence NULL for IDAT chunks, or the next APNG sequence number, advanced past the fdAT chunks.
+ * @return int 1 if successful, 0 otherwise.
  */
-void simulate_drop(int height, int width, double heightmap[width][height], struct drop drop, struct parameters param)
+static int write_png_data(FILE *f, const unsigned char *pixels, int stride, int width, int height, int bpp, int filter, int quality, uint32_t *sequence)
 {
-    while (drop.lifetime > 0 && verify_drop_pos(drop, width, height) && drop.water > EPSILON)
+    long image_bytes = (long)(width * bpp + 1) * height;
+    int nb_bands = (int)MIN(MAX(image_bytes / PNG_BAND_BYTES, 1), (long)height);
+
+    struct png_band *bands = (struct png_band *)calloc(nb_bands, sizeof(struct png_band));
+    if (bands == NULL)
+        return 0;
+    for (int b = 0; b < nb_bands; ++b)
     {
-        // 0 - update lifetime
-        drop.lifetime--;
+        bands[b].pixels = pixels;
+        bands[b].stride = stride;
+        bands[b].width = width;
+        bands[b].height = height;
+        bands[b].bpp = bpp;
+        bands[b].begin = (int)((long)height * b / nb_bands);
+        bands[b].end = (int)((long)height * (b + 1) / nb_bands);
+        bands[b].last = b == nb_bands - 1;
+        bands[b].filter = filter;
+        bands[b].quality = quality;
+        bands[b].sequence = sequence != NULL ? *sequence + 1 + b : 0; // after the zlib header chunk
+    }
+    parallel_rows(nb_bands, encode_png_bands, bands);
 
-        // 1 - get gradient
-        vec2 gradient = compute_gradient(width, *heightmap, drop.position);
+    // zlib header and trailer chunks around the band chunks
+    uint32_t adler = 1;
+    int result = 1;
+    for (int b = 0; b < nb_bands; ++b)
+    {
+        result = result && bands[b].chunk_len > 0;
+        adler = adler32_combine(adler, bands[b].adler, bands[b].filtered_len);
+    }
+    unsigned char zlib_header[2] = {0x78, 0x5e}; // DEFLATE 32K window, FLEVEL = 1
+    unsigned char zlib_trailer[4];
+    unsigned char *o = zlib_trailer;
+    stbiw__wp32(o, adler);
 
-        // 2 - new direction
-        vec2 new_dir;
-        new_dir.x = drop.direction.x * param.inertia - gradient.x * (1.0 - param.inertia);
-        new_dir.y = drop.direction.y * param.inertia - gradient.y * (1.0 - param.inertia);
+    if (result)
+    {
+        result = write_png_data_chunk(f, zlib_header, 2, sequence);
+        for (int b = 0; b < nb_bands && result; ++b)
+            result = fwrite(bands[b].chunk, 1, bands[b].chunk_len, f) == (size_t)bands[b].chunk_len;
+        if (sequence != NULL)
+            *sequence += nb_bands;
+        result = result && write_png_data_chunk(f, zlib_trailer, 4, sequence);
+    }
 
-        double norm = sqrt(new_dir.x * new_dir.x + new_dir.y * new_dir.y);
-        while (norm <= EPSILON) // hopefully we don't stay here too long
-        {
-            new_dir.x = random_double(rand());
-            new_dir.y = random_double(rand());
-            norm = sqrt(new_dir.x * new_dir.x + new_dir.y * new_dir.y);
-        }
-        new_dir.x /= norm;
-        new_dir.y /= norm;
+    for (int b = 0; b < nb_bands; ++b)
+        free(bands[b].chunk);
+    free(bands);
+    return result;
+}
 
-        // 3 - new position
-        vec2 old_pos = drop.position;
-        drop.position.x = drop.position.x + new_dir.x;
-        drop.position.y = drop.position.y + new_dir.y;
+/**
+ * @brief Writes the signature and the IHDR chunk of a PNG.
+ *
+ * @param f Stream receiving the PNG.
+ * @param width Width of the image.
+ * @param height Height of the image.
+ * @param channels Number of channels: 1 (gray), 2 (gray + alpha), 3 (RGB) or 4 (RGBA).
+ * @param bit_depth Bits per channel: 8 or 16.
+ * @return int 1 if successful, 0 otherwise.
+ */
+static int write_png_header(FILE *f, int width, int height, int channels, int bit_depth)
+{
+    static const int color_types[5] = {-1, 0, 4, 2, 6};
+    unsigned char head[8 + 12 + 13];
+    unsigned char *o = head;
+    memcpy(o, "\x89PNG\r\n\x1a\n", 8);
+    o += 8;
+    stbiw__wp32(o, 13);
+    stbiw__wptag(o, "IHDR");
+    stbiw__wp32(o, width);
+    stbiw__wp32(o, height);
+    *o++ = (unsigned char)bit_depth;
+    *o++ = (unsigned char)color_types[channels];
+    *o++ = 0; // compression
+    *o++ = 0; // filter
+    *o++ = 0; // interlace
+    stbiw__wpcrc(&o, 13);
+    return fwrite(head, 1, sizeof(head), f) == sizeof(head);
+}
 
-        // gone: went out of bound
-        if (!verify_drop_pos(drop, width, height))
-            break;
+/**
+ * @brief Writes the IEND chunk closing a PNG.
+ *
+ * @param f Stream receiving the PNG.
+ * @return int 1 if successful, 0 otherwise.
+ */
+static int write_png_end(FILE *f)
+{
+    unsigned char end[12];
+    unsigned char *o = end;
+    stbiw__wp32(o, 0);
+    stbiw__wptag(o, "IEND");
+    stbiw__wpcrc(&o, 0);
+    return fwrite(end, 1, sizeof(end), f) == sizeof(end);
+}
 
-        // 4 - height difference h_diff
-        double h_diff = H(*heightmap, width, (int)drop.position.x, (int)drop.position.y) -
-                        H(*heightmap, width, (int)old_pos.x, (int)old_pos.y);
+/**
+ * @brief Reads a big endian 32-bit integer, as PNG chunks store them.
+ *
+ * @param data The 4 bytes.
+ * @return uint32_t The integer.
+ */
+static uint32_t read_be32(const unsigned char *data)
+{
+    return (uint32_t)data[0] << 24 | (uint32_t)data[1] << 16 | (uint32_t)data[2] << 8 | data[3];
+}
 
-        if (h_diff > 0.0)
+/**
+ * @brief Decodes a PNG file written by write_png(): 8 or 16-bit samples, not interlaced.
+ *
+ * Chunks other than IHDR and IDAT are skipped. The zlib stream of the IDAT
+ * chunks is inflated in one go, then the rows are unfiltered in place.
+ *
+ * @param png The PNG file.
+ * @param size Size of the file.
+ * @param width Set to the width of the image.
+ * @param height Set to the height of the image.
+ * @param channels Set to the number of channels.
+ * @param bit_depth Set to the bits per channel.
+ * @return unsigned char* The samples, rows stored one after the other (16-bit samples big endian), to free; NULL if the file is invalid.
+ */
+static unsigned char *read_png(const unsigned char *png, size_t size, int *width, int *height, int *channels, int *bit_depth)
+{
+    static const int color_channels[7] = {1, 0, 3, 0, 2, 0, 4};
+    if (size < 8 || memcmp(png, "\x89PNG\r\n\x1a\n", 8) != 0)
+        return NULL;
+
+    // gather the zlib stream of the IDAT chunks
+    unsigned char *zlib = NULL;
+    size_t zlib_size = 0;
+    int valid = 0, ended = 0;
+    *width = *height = *channels = *bit_depth = 0;
+    for (size_t pos = 8; pos + 12 <= size && !ended;)
+    {
+        uint32_t len = read_be32(png + pos);
+        const unsigned char *type = png + pos + 4, *data = png + pos + 8;
+        if (len > size - pos - 12)
+            break;
+        if (memcmp(type, "IHDR", 4) == 0 && len == 13)
         {
-            double to_drop;
-            double keep_going = drop.sediment >= h_diff;
-            if (keep_going)
+            *width = (int)read_be32(data);
+            *height = (int)read_be32(data + 4);
+            *bit_depth = data[8];
+            *channels = data[9] < 7 ? color_channels[data[9]] : 0;
+            valid = *width > 0 && *height > 0 && *channels > 0 && (*bit_depth == 8 || *bit_depth == 16) && data[10] == 0 && data[11] == 0 && data[12] == 0;
+        }
+        else if (memcmp(type, "IDAT", 4) == 0)
+        {
+            unsigned char *grown = (unsigned char *)realloc(zlib, zlib_size + len);
+            if (grown == NULL)
             {
-                to_drop = h_diff;
-                to_drop -= simulate_deposition(width, height, heightmap, old_pos, to_drop);
-                while (to_drop > EPSILON)
-                    to_drop -= simulate_deposition(width, height, heightmap, old_pos, drop.sediment);
+                valid = 0;
                 break;
             }
-            else
+            zlib = grown;
+            memcpy(zlib + zlib_size, data, len);
+            zlib_size += len;
+        }
+        ended = memcmp(type, "IEND", 4) == 0;
+        pos += 12 + (size_t)len;
+    }
+
+    int bpp = *channels * *bit_depth / 8;
+    size_t row = (size_t)*width * bpp;
+    unsigned char *pixels = valid && ended && zlib_size > 2 && (zlib[0] & 0x0f) == 8 ? (unsigned char *)malloc((row + 1) * *height) : NULL;
+    valid = pixels != NULL && inflate_raw(zlib + 2, zlib_size - 2, pixels, (row + 1) * *height);
+    free(zlib);
+    if (!valid)
+    {
+        free(pixels);
+        return NULL;
+    }
+
+    // unfilter each row and move it over the filter byte before it
+    for (int y = 0; y < *height && valid; ++y)
+    {
+        unsigned char *out = pixels + (size_t)y * row;
+        const unsigned char *in = pixels + (size_t)y * (row + 1);
+        const unsigned char *prior = y > 0 ? out - row : NULL;
+        int filter = in[0];
+        valid = filter <= 4;
+        for (size_t i = 0; i < row && valid; ++i)
+        {
+            int a = i >= (size_t)bpp ? out[i - bpp] : 0;
+            int b = prior != NULL ? prior[i] : 0;
+            int c = prior != NULL && i >= (size_t)bpp ? prior[i - bpp] : 0;
+            int predictor = 0;
+            if (filter == 1)
+                predictor = a;
+            else if (filter == 2)
+                predictor = b;
+            else if (filter == 3)
+                predictor = (a + b) / 2;
+            else if (filter == 4)
             {
-                to_drop = drop.sediment;
-                drop.sediment -= simulate_deposition(width, height, heightmap, old_pos, to_drop);
-                while (drop.sediment > EPSILON)
-                    drop.sediment -= simulate_deposition(width, height, heightmap, old_pos, drop.sediment);
-                break;
+                int p = a + b - c, pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+                predictor = pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
             }
+            out[i] = (unsigned char)(in[i + 1] + predictor);
         }
-        else
+    }
+    if (!valid)
+    {
+        free(pixels);
+        return NULL;
+    }
+    return pixels;
+}
+
+/**
+ * @brief Returns the deflate quality of a PNG profile, see deflate_piece().
+ *
+ * @param profile Speed / size trade-off of the encoding.
+ * @return int Deflate quality.
+ */
+static int png_profile_quality(enum png_profile profile)
+{
+    return profile == PNG_ARCHIVAL ? stbi_write_png_compression_level : profile == PNG_FAST ? 1 : 0;
+}
+
+/**
+ * @brief Writes a PNG file, see write_png_data() for the parallel encoding.
+ *
+ * @param f Stream receiving the PNG file.
+ * @param pixels First row of the image, rows stored one after the other.
+ * @param width Width of the image.
+ * @param height Height of the image.
+ * @param channels Number of channels: 1 (gray), 2 (gray + alpha), 3 (RGB) or 4 (RGBA).
+ * @param bit_depth Bits per channel: 8 or 16 (big endian samples).
+ * @param profile Speed / size trade-off of the encoding.
+ * @return int 1 if successful, 0 otherwise.
+ */
+static int write_png(FILE *f, const unsigned char *pixels, int width, int height, int channels, int bit_depth, enum png_profile profile)
+{
+    int result = write_png_header(f, width, height, channels, bit_depth);
+    int bpp = channels * bit_depth / 8;
+    int filter = profile == PNG_ARCHIVAL ? -1 : 2; // up: terrain rows look alike
+    result = result && write_png_data(f, pixels, width * bpp, width, height, bpp, filter, png_profile_quality(profile), NULL);
+    return result && write_png_end(f);
+}
+
+/**
+ * @brief Returns the file extension of a snapshot format.
+ *
+ * @param format Format of the snapshot.
+ * @return const char* Extension, with the dot.
+ */
+static const char *format_extension(enum image_format format)
+{
+    return format == RAW_F64 || format == RAW_F32 || format == RAW_U16 ? ".hmap" : ".png";
+}
+
+/**
+ * @brief Fills the raw_header of a snapshot and converts its samples.
+ *
+ * @param width Width of the heightmap.
+ * @param height Height of the heightmap.
+ * @param heightmap Row-major heightmap.
+ * @param format RAW_F64, RAW_F32 or RAW_U16.
+ * @param header Header to fill.
+ * @param samples_size Size of the samples in bytes.
+ * @return void* The heightmap itself for RAW_F64, a converted copy to free otherwise, NULL on allocation error.
+ */
+static void *raw_samples(int width, int height, const double *heightmap, enum image_format format, struct raw_header *header, size_t *samples_size)
+{
+    struct raw_header h = {{'H', 'M', 'A', 'P'}, 1, (uint32_t)width, (uint32_t)height, (uint32_t)format, sizeof(struct raw_header), 1.0};
+    size_t count = (size_t)width * height;
+    *header = h;
+    *samples_size = count * (format == RAW_F64 ? 8 : format == RAW_F32 ? 4 : 2);
+
+    if (format == RAW_F32)
+    {
+        float *converted = (float *)malloc(count * sizeof(float));
+        if (converted != NULL)
+            for (size_t i = 0; i < count; ++i)
+                converted[i] = (float)heightmap[i];
+        return converted;
+    }
+    if (format == RAW_U16)
+    {
+        // little endian on every host, as load_heightmap() reads it
+        unsigned char *converted = (unsigned char *)malloc(count * 2);
+        if (converted != NULL)
         {
-            // 5 - new capacity c
-            double c = MAX(-h_diff, param.slope) * drop.velocity * drop.water * param.capacity;
-            if (drop.sediment >= c) // deposit
+            for (size_t i = 0; i < count; ++i)
             {
-                double to_drop = (drop.sediment - c) * param.deposition;
-                double dropped = simulate_deposition(width, height, heightmap, old_pos, to_drop);
-                drop.sediment -= dropped;
+                uint16_t sample = (uint16_t)(MIN(MAX(heightmap[i], 0.0), 255.0) * 257.0 + 0.5);
+                converted[2 * i] = sample & 0xff;
+                converted[2 * i + 1] = sample >> 8;
             }
-            else // erode
+        }
+        header->scale = 1.0 / 257.0;
+        return converted;
+    }
+    return (void *)heightmap;
+}
+
+/**
+ * @brief Saves the heightmap as a raw snapshot: a raw_header followed by the samples.
+ *
+ * RAW_F64 is written straight from the heightmap buffer with a single
+ * writev() and no conversion: the snapshot is lossless and costs only the
+ * I/O. RAW_F32 and RAW_U16 convert the samples first and halve or quarter the
+ * size. RAW_U16 samples are little endian; float samples are in host byte
+ * order, and load_heightmap() maps RAW_F64 snapshots back without any conversion.
+ *
+ * @param width Width of the heightmap.
+ * @param height Height of the heightmap.
+ * @param heightmap Row-major heightmap.
+ * @param filename Name of the output file.
+ * @param format RAW_F64, RAW_F32 or RAW_U16.
+ * @return int 1 if successful, 0 otherwise.
+ */
+static int save_heightmap_raw(int width, int height, const double *heightmap, const char *filename, enum image_format format)
+{
+    struct raw_header header;
+    size_t samples_size;
+    void *samples = raw_samples(width, height, heightmap, format, &header, &samples_size);
+    if (samples == NULL)
+        return 0;
+
+    int result = 0;
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd >= 0)
+    {
+        struct iovec iov[2] = {{&header, sizeof(header)}, {samples, samples_size}};
+        size_t remaining = iov[0].iov_len + iov[1].iov_len;
+        ssize_t written;
+
+        // a single writev() unless the kernel writes less than asked
+        while (remaining > 0 && (written = writev(fd, iov, 2)) > 0)
+        {
+            remaining -= written;
+            for (int i = 0; i < 2; ++i)
             {
-                double gain = MIN((c - drop.sediment) * param.erosion, -h_diff);
-                double total_weight = 0.0;
-                int size_weights = (2 * param.radius + 1) * (2 * param.radius + 1);
-                struct weight weights[size_weights];
-                int index = 0;
-                // Iterate over the radius square
-                for (int dx = -param.radius; dx <= param.radius; ++dx)
-                {
-                    for (int dy = -param.radius; dy <= param.radius; ++dy)
-                    {
+                size_t step = MIN((size_t)written, iov[i].iov_len);
+                iov[i].iov_base = (char *)iov[i].iov_base + step;
+                iov[i].iov_len -= step;
+                written -= step;
+            }
+        }
+        result = remaining == 0;
+        result = close(fd) == 0 && result;
+    }
 
-                        int x = (int)(old_pos.x + dx);
-                        int y = (int)(old_pos.y + dy);
+    if (samples != (void *)heightmap)
+        free(samples);
+    return result;
+}
 
-                        weights[index].used = 0;
-                        if (0 <= x && x < width && 0 <= y && y < height)
-                        {
-                            double dist = sqrt(dx * dx + dy * dy);
-                            if (dist <= (double)param.radius)
-                            {
-                                weights[index].w = (double)param.radius - dist;
-                                weights[index].x = x;
-                                weights[index].y = y;
-                                total_weight += weights[index].w;
-                                weights[index].used = 1;
-                            }
-                        }
+/**
+ * @brief Converts a rectangle of the heightmap to PNG samples.
+ *
+ * IMAGE_RGB8 and IMAGE_GRAY8 truncate heights to 8 bits, IMAGE_GRAY16 maps
+ * heights 0 - 255 to 0 - 65535 in big endian.
+ *
+ * @param heightmap Row-major heightmap.
+ * @param width Width of the heightmap and of the image.
+ * @param x0 First column of the rectangle.
+ * @param y0 First row of the rectangle.
+ * @param x1 Last column of the rectangle.
+ * @param y1 Last row of the rectangle.
+ * @param format IMAGE_RGB8, IMAGE_GRAY8 or IMAGE_GRAY16.
+ * @param image Image of the whole heightmap, only the rectangle is written.
+ */
+static void heightmap_to_pixels(const double *heightmap, int width, int x0, int y0, int x1, int y1, enum image_format format, unsigned char *image)
+{
+    int bytes_per_pixel = format == IMAGE_RGB8 ? 3 : format == IMAGE_GRAY16 ? 2 : 1;
+    for (int y = y0; y <= y1; y++)
+    {
+        for (int x = x0; x <= x1; x++)
+        {
+            long idx = ((long)y * width + x) * bytes_per_pixel; // Index for the image
+            double h = heightmap[(long)y * width + x];
+            if (format == IMAGE_GRAY16)
+            {
+                // 0 - 255 to 0 - 65535, big endian
+                unsigned short value = (unsigned short)(MIN(MAX(h, 0.0), 255.0) * 257.0 + 0.5);
+                image[idx] = value >> 8;
+                image[idx + 1] = value & 0xff;
+                continue;
+            }
+            unsigned char value = (unsigned char)h;
+            image[idx] = value; // R or gray
+            if (format == IMAGE_RGB8)
+            {
+                image[idx + 1] = value; // G
+                image[idx + 2] = value; // B
+            }
+        }
+    }
+}
 
-                        ++index;
-                    }
-                }
+/**
+ * @brief Writes an unsigned integer as a LEB128 varint: 7 bits per byte, low bits first.
+ *
+ * @param out Destination, 10 bytes at most.
+ * @param value The integer.
+ * @return size_t Number of bytes written.
+ */
+static size_t write_varint(unsigned char *out, uint64_t value)
+{
+    size_t len = 0;
+    do
+    {
+        out[len++] = (unsigned char)((value & 0x7f) | (value >= 0x80 ? 0x80 : 0));
+        value >>= 7;
+    } while (value != 0);
+    return len;
+}
+
+/**
+ * @brief Reads a LEB128 varint written by write_varint().
+ *
+ * @param data The data.
+ * @param size Size of the data.
+ * @param pos Offset of the varint, advanced past it.
+ * @param value Set to the integer.
+ * @return int 1 if successful, 0 if the data ends first.
+ */
+static int read_varint(const unsigned char *data, size_t size, size_t *pos, uint64_t *value)
+{
+    *value = 0;
+    for (int shift = 0; *pos < size && shift < 64; shift += 7)
+    {
+        unsigned char byte = data[(*pos)++];
+        *value |= (uint64_t)(byte & 0x7f) << shift;
+        if (byte < 0x80)
+            return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Writes a residual frame: the changed tiles of a snapshot, as differences with the previous one.
+ *
+ * The frame is a residual_header, the indices of the DIRTY_TILE x DIRTY_TILE
+ * tiles whose samples changed, then the difference of each sample of these
+ * tiles with the previous snapshot, modulo 256 (65536 for IMAGE_GRAY16), one
+ * per cell, tile after tile and row by row inside a tile. The differences are
+ * run-length coded, a varint count of zero samples then a varint count of
+ * literal samples and the samples, and these runs are deflated. Tiles
+ * nothing wrote to are not even converted. apply_residual_frame() decodes it.
+ *
+ * @param f Stream receiving the frame.
+ * @param width Width of the heightmap.
+ * @param height Height of the heightmap.
+ * @param heightmap Row-major heightmap.
+ * @param options Pixel format and encoding profile.
+ * @param delta Previous snapshot of the run, updated.
+ * @param dirty Cells written since the previous snapshot, NULL for all of them.
+ * @param image Image of the whole heightmap, only the dirty tiles are converted.
+ * @return int 1 if successful, 0 otherwise.
+ */
+static int write_residual_frame(FILE *f, int width, int height, const double *heightmap, const struct run_options *options, struct delta_state *delta, const struct dirty_tracker *dirty, unsigned char *image)
+{
+    enum image_format format = options->format;
+    int bytes_per_pixel = format == IMAGE_RGB8 ? 3 : format == IMAGE_GRAY16 ? 2 : 1;
+    int sample_bytes = format == IMAGE_GRAY16 ? 2 : 1;
+    int tiles_x = (width + DIRTY_TILE - 1) / DIRTY_TILE;
+    int tiles_y = (height + DIRTY_TILE - 1) / DIRTY_TILE;
+    size_t nb_cells = (size_t)width * height;
+    uint32_t *tiles = (uint32_t *)malloc((size_t)tiles_x * tiles_y * sizeof(uint32_t));
+    unsigned char *residuals = (unsigned char *)malloc(nb_cells * sample_bytes);
+    unsigned char *runs = (unsigned char *)malloc(nb_cells * (sample_bytes + 2) + 16); // a zero and a literal run cost 2 varint bytes
+    if (tiles == NULL || residuals == NULL || runs == NULL)
+    {
+        printf("Memory allocation error for the residual frame.\n");
+        free(tiles);
+        free(residuals);
+        free(runs);
+        return 0;
+    }
+
+    // differences of the tiles that changed, the reference takes the new samples
+    unsigned char *reference = delta->reference;
+    uint32_t nb_tiles = 0;
+    size_t count = 0;
+    for (int ty = 0; ty < tiles_y; ++ty)
+    {
+        for (int tx = 0; tx < tiles_x; ++tx)
+        {
+            if (!dirty_tile(dirty, tx, ty))
+                continue;
+            int x0 = tx * DIRTY_TILE, x1 = MIN(x0 + DIRTY_TILE, width) - 1;
+            int y0 = ty * DIRTY_TILE, y1 = MIN(y0 + DIRTY_TILE, height) - 1;
+            heightmap_to_pixels(heightmap, width, x0, y0, x1, y1, format, image);
+            size_t first = count;
+            int changed = 0;
+            for (int y = y0; y <= y1; ++y)
+            {
+                for (int x = x0; x <= x1; ++x)
+                {
+                    size_t i = ((size_t)y * width + x) * bytes_per_pixel;
+                    if (sample_bytes == 2)
+                    {
+                        unsigned short residual = (unsigned short)(((image[i] << 8 | image[i + 1]) - (reference[i] << 8 | reference[i + 1])) & 0xffff);
+                        residuals[2 * count] = residual >> 8;
+                        residuals[2 * count + 1] = residual & 0xff;
+                        changed |= residual != 0;
+                    }
+                    else
+                    {
+                        residuals[count] = (unsigned char)(image[i] - reference[i]);
+                        changed |= residuals[count] != 0;
+                    }
+                    memcpy(reference + i, image + i, bytes_per_pixel);
+                    ++count;
+                }
+            }
+            if (changed)
+                tiles[nb_tiles++] = (uint32_t)(ty * tiles_x + tx);
+            else
+                count = first;
+        }
+    }
+
+    // alternate runs of zero samples and of literal samples
+    size_t runs_size = 0;
+    for (size_t i = 0; i < count;)
+    {
+        size_t start = i;
+        while (i < count && residuals[i * sample_bytes] == 0 && residuals[(i + 1) * sample_bytes - 1] == 0)
+            ++i;
+        runs_size += write_varint(runs + runs_size, i - start);
+        start = i;
+        while (i < count && (residuals[i * sample_bytes] != 0 || residuals[(i + 1) * sample_bytes - 1] != 0))
+            ++i;
+        runs_size += write_varint(runs + runs_size, i - start);
+        memcpy(runs + runs_size, residuals + start * sample_bytes, (i - start) * sample_bytes);
+        runs_size += (i - start) * sample_bytes;
+    }
+
+    int deflated_len = 0;
+    unsigned char *deflated = deflate_piece(runs, (int)runs_size, png_profile_quality(options->profile), 1, &deflated_len);
+    struct residual_header header = {{'H', 'R', 'E', 'S'}, 1, (uint32_t)width, (uint32_t)height, (uint32_t)format,
+                                     (uint32_t)delta->reference_drop, (uint32_t)delta->keyframe_drop, nb_tiles, runs_size};
+    int result = deflated != NULL && fwrite(&header, sizeof(header), 1, f) == 1 && fwrite(tiles, sizeof(uint32_t), nb_tiles, f) == nb_tiles
+                 && fwrite(deflated, 1, deflated_len, f) == (size_t)deflated_len;
+    if (deflated != NULL)
+        stbiw__sbfree(deflated);
+    free(tiles);
+    free(residuals);
+    free(runs);
+    return result;
+}
+
+/**
+ * @brief Adds the residuals of a residual frame to the samples of the previous frame.
+ *
+ * @param payload The residual frame, see write_residual_frame().
+ * @param size Size of the frame.
+ * @param width Width of the frames.
+ * @param height Height of the frames.
+ * @param format Pixel format of the frames.
+ * @param image Samples of the previous frame, replaced by those of this frame.
+ * @return int 1 if successful, 0 if the frame is invalid.
+ */
+static int apply_residual_frame(const unsigned char *payload, size_t size, int width, int height, enum image_format format, unsigned char *image)
+{
+    struct residual_header header;
+    int bytes_per_pixel = format == IMAGE_RGB8 ? 3 : format == IMAGE_GRAY16 ? 2 : 1;
+    int sample_bytes = format == IMAGE_GRAY16 ? 2 : 1;
+    int tiles_x = (width + DIRTY_TILE - 1) / DIRTY_TILE;
+    int tiles_y = (height + DIRTY_TILE - 1) / DIRTY_TILE;
+    if (size < sizeof(header))
+        return 0;
+    memcpy(&header, payload, sizeof(header));
+    size_t tiles_size = (size_t)header.nb_tiles * sizeof(uint32_t);
+    if (memcmp(header.magic, "HRES", 4) != 0 || header.version != 1 || header.width != (uint32_t)width || header.height != (uint32_t)height
+        || header.format != (uint32_t)format || header.nb_tiles > (uint32_t)(tiles_x * tiles_y) || size - sizeof(header) < tiles_size
+        || header.runs_size > (uint64_t)width * height * (sample_bytes + 2) + 16)
+        return 0;
+
+    const unsigned char *tiles = payload + sizeof(header);
+    unsigned char *runs = (unsigned char *)malloc(MAX(header.runs_size, 1));
+    int valid = runs != NULL && inflate_raw(tiles + tiles_size, size - sizeof(header) - tiles_size, runs, header.runs_size);
+
+    // walk the cells of the tiles and the runs together
+    size_t pos = 0;
+    uint64_t zeros = 0, literals = 0;
+    for (uint32_t t = 0; t < header.nb_tiles && valid; ++t)
+    {
+        uint32_t tile;
+        memcpy(&tile, tiles + t * sizeof(uint32_t), sizeof(uint32_t));
+        valid = tile < (uint32_t)(tiles_x * tiles_y);
+        int x0 = (int)(tile % tiles_x) * DIRTY_TILE, x1 = MIN(x0 + DIRTY_TILE, width) - 1;
+        int y0 = (int)(tile / tiles_x) * DIRTY_TILE, y1 = MIN(y0 + DIRTY_TILE, height) - 1;
+        for (int y = y0; y <= y1 && valid; ++y)
+        {
+            for (int x = x0; x <= x1 && valid; ++x)
+            {
+                if (zeros == 0 && literals == 0)
+                    valid = read_varint(runs, header.runs_size, &pos, &zeros) && read_varint(runs, header.runs_size, &pos, &literals) && zeros + literals > 0;
+                if (!valid)
+                    continue;
+                if (zeros > 0)
+                {
+                    --zeros;
+                    continue;
+                }
+                --literals;
+                valid = pos + sample_bytes <= header.runs_size;
+                if (!valid)
+                    continue;
+                size_t i = ((size_t)y * width + x) * bytes_per_pixel;
+                if (sample_bytes == 2)
+                {
+                    unsigned short value = (unsigned short)(((image[i] << 8 | image[i + 1]) + (runs[pos] << 8 | runs[pos + 1])) & 0xffff);
+                    image[i] = value >> 8;
+                    image[i + 1] = value & 0xff;
+                }
+                else
+                    memset(image + i, (unsigned char)(image[i] + runs[pos]), bytes_per_pixel);
+                pos += sample_bytes;
+            }
+        }
+    }
+    valid = valid && literals == 0 && pos == header.runs_size;
+    free(runs);
+    return valid;
+}
+
+/**
+ * @brief Encodes the heightmap in a snapshot format and writes it to a stream.
+ *
+ * With a delta state and options->keyframe_interval > 1, only one PNG
+ * snapshot in keyframe_interval is a plain image, a keyframe. The others are
+ * residual frames holding only the changed tiles, see write_residual_frame():
+ * between snapshots most samples do not change, and adding the residuals to
+ * the keyframe gives the snapshots back exactly (archive_decode_frame()).
+ * Raw snapshots are always complete.
+ *
+ * @param f Stream receiving the PNG or raw snapshot.
+ * @param width Width of the heightmap.
+ * @param height Height of the heightmap.
+ * @param heightmap Row-major heightmap.
+ * @param options Pixel format, encoding profile and keyframe interval.
+ * @param delta Previous snapshot of the run, updated; NULL for a standalone image.
+ * @param dirty Cells written since the previous snapshot, NULL for all of them.
+ * @param nb_drop Number of drops simulated before the snapshot.
+ * @return int 1 if successful, 0 otherwise.
+ */
+static int encode_heightmap(FILE *f, int width, int height, const double *heightmap, const struct run_options *options, struct delta_state *delta, const struct dirty_tracker *dirty, int nb_drop)
+{
+    enum image_format format = options->format;
+    if (format == RAW_F64 || format == RAW_F32 || format == RAW_U16)
+    {
+        struct raw_header header;
+        size_t samples_size;
+        void *samples = raw_samples(width, height, heightmap, format, &header, &samples_size);
+        if (samples == NULL)
+            return 0;
+        int result = fwrite(&header, sizeof(header), 1, f) == 1 && fwrite(samples, 1, samples_size, f) == samples_size;
+        if (samples != (void *)heightmap)
+            free(samples);
+        return result;
+    }
+
+    // Create a byte array for the image (1 to 3 bytes per pixel)
+    int bytes_per_pixel = format == IMAGE_RGB8 ? 3 : format == IMAGE_GRAY16 ? 2 : 1;
+    size_t image_size = (size_t)width * height * bytes_per_pixel;
+    unsigned char *image = (unsigned char *)calloc(image_size, sizeof(unsigned char));
+    if (image == NULL)
+    {
+        printf("Memory allocation error for the image.\n");
+        return 0;
+    }
+
+    // Save the image as PNG, or its residual against the previous snapshot
+    int channels = format == IMAGE_RGB8 ? 3 : 1;
+    int bit_depth = format == IMAGE_GRAY16 ? 16 : 8;
+    int result;
+    if (delta != NULL && delta->reference != NULL && options->keyframe_interval > 1 && delta->nb_frames % options->keyframe_interval != 0)
+    {
+        result = write_residual_frame(f, width, height, heightmap, options, delta, dirty, image);
+    }
+    else
+    {
+        heightmap_to_pixels(heightmap, width, 0, 0, width - 1, height - 1, format, image);
+        result = write_png(f, image, width, height, channels, bit_depth, options->profile);
+        if (delta != NULL)
+        {
+            if (delta->reference == NULL)
+                delta->reference = (unsigned char *)malloc(image_size);
+            if (delta->reference != NULL)
+                memcpy(delta->reference, image, image_size);
+            delta->keyframe_drop = nb_drop;
+        }
+    }
+    if (delta != NULL)
+    {
+        delta->reference_drop = nb_drop;
+        delta->nb_frames++;
+    }
+
+    // Free memory
+    free(image);
+    return result;
+}
+
+/**
+ * @brief Saves the heightmap as an image file.
+ *
+ * IMAGE_RGB8 and IMAGE_GRAY8 store the same 8-bit values, the gray version
+ * with a third of the bytes to filter, compress and write. IMAGE_GRAY16 maps
+ * heights 0 - 255 to 0 - 65535 and keeps sub-integer erosion detail. RAW_*
+ * formats are written by save_heightmap_raw() instead of being encoded. The
+ * encoding speed, in MB of pixels per second, is printed with the file name.
+ *
+ * @param width Width of the heightmap.
+ * @param height Height of the heightmap.
+ * @param heightmap 2D array representing the heightmap.
+ * @param filename Name of the output image file.
+ * @param options Pixel format and encoding profile, NULL for RUN_OPTIONS_DEFAULT.
+ */
+void save_heightmap_as_image(int width, int height, double heightmap[width][height], const char *filename, const struct run_options *options)
+{
+    struct run_options default_options = RUN_OPTIONS_DEFAULT;
+    if (options == NULL)
+        options = &default_options;
+    enum image_format format = options->format;
+
+    // Create the necessary directories
+    if (create_parent_directories(filename) != 0)
+        return;
+
+    if (format == RAW_F64 || format == RAW_F32 || format == RAW_U16)
+    {
+        double start = get_time();
+        if (save_heightmap_raw(width, height, *heightmap, filename, format))
+            printf("Heightmap successfully saved as: %s (%.1f MB/s)\n", filename, (double)width * height * sizeof(double) / 1e6 / MAX(get_time() - start, 1e-9));
+        else
+            printf("Error saving the heightmap.\n");
+        return;
+    }
+
+    double start = get_time();
+    FILE *f = fopen(filename, "wb");
+    int result = f != NULL && encode_heightmap(f, width, height, *heightmap, options, NULL, NULL, 0);
+    result = f != NULL && fclose(f) == 0 && result;
+    double elapsed = get_time() - start;
+    if (result)
+    {
+        int bytes_per_pixel = format == IMAGE_RGB8 ? 3 : format == IMAGE_GRAY16 ? 2 : 1;
+        printf("Image successfully saved as: %s (%.1f MB/s)\n", filename, (double)width * height * bytes_per_pixel / 1e6 / MAX(elapsed, 1e-9));
+    }
+    else
+    {
+        printf("Error saving the image.\n");
+    }
+}
+
+/**
+ * @brief Writes the acTL chunk of an animated PNG.
+ *
+ * @param f Stream receiving the chunk.
+ * @param nb_frames Number of frames.
+ * @return int 1 if successful, 0 otherwise.
+ */
+static int write_apng_actl(FILE *f, int nb_frames)
+{
+    unsigned char chunk[12 + 8];
+    unsigned char *o = chunk;
+    stbiw__wp32(o, 8);
+    stbiw__wptag(o, "acTL");
+    stbiw__wp32(o, nb_frames);
+    stbiw__wp32(o, 0); // loop forever
+    stbiw__wpcrc(&o, 8);
+    return fwrite(chunk, 1, sizeof(chunk), f) == sizeof(chunk);
+}
+
+/**
+ * @brief Creates an animated PNG and writes its header.
+ *
+ * The PNG signature, IHDR and an acTL chunk are written right away; the
+ * frame count of acTL is only known, and rewritten, on apng_close().
+ *
+ * @param apng The writer to open.
+ * @param filename Name of the animated PNG.
+ * @param width Width of the frames.
+ * @param height Height of the frames.
+ * @param options Pixel format and encoding profile of the frames, NULL for RUN_OPTIONS_DEFAULT.
+ * @return int 0 if successful, -1 if there is an error.
+ */
+int apng_open(struct apng_writer *apng, const char *filename, int width, int height, const struct run_options *options)
+{
+    struct run_options default_options = RUN_OPTIONS_DEFAULT;
+    if (options == NULL)
+        options = &default_options;
+
+    memset(apng, 0, sizeof(*apng));
+    apng->width = width;
+    apng->height = height;
+    apng->format = options->format;
+    apng->profile = options->profile;
+    int bytes_per_pixel = apng->format == IMAGE_RGB8 ? 3 : apng->format == IMAGE_GRAY16 ? 2 : 1;
+    apng->pixels = (unsigned char *)malloc((size_t)width * height * bytes_per_pixel);
+    if (apng->pixels == NULL || create_parent_directories(filename) != 0 || (apng->f = fopen(filename, "wb")) == NULL)
+    {
+        printf("Error creating the animated image: %s\n", filename);
+        free(apng->pixels);
+        apng->pixels = NULL;
+        return -1;
+    }
+
+    int result = write_png_header(apng->f, width, height, apng->format == IMAGE_RGB8 ? 3 : 1, apng->format == IMAGE_GRAY16 ? 16 : 8);
+    apng->actl_offset = ftell(apng->f);
+    if (!result || !write_apng_actl(apng->f, 0))
+    {
+        printf("Error writing the animated image: %s\n", filename);
+        fclose(apng->f);
+        free(apng->pixels);
+        apng->f = NULL;
+        apng->pixels = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Appends a frame holding the cells written since the previous frame.
+ *
+ * The first frame is the whole heightmap, stored in IDAT so viewers without
+ * APNG support show it. The following ones only cover the bounding rectangle
+ * of the dirty cells: only that rectangle is converted, filtered and
+ * deflated, and it replaces the same rectangle of the previous frame
+ * (APNG_DISPOSE_OP_NONE, APNG_BLEND_OP_SOURCE).
+ *
+ * @param apng The writer.
+ * @param heightmap Row-major heightmap.
+ * @param dirty Cells written since the previous frame, NULL for all of them.
+ * @return int 0 if successful, -1 if there is an error.
+ */
+int apng_write_frame(struct apng_writer *apng, const double *heightmap, const struct dirty_tracker *dirty)
+{
+    int x0 = 0, y0 = 0, x1 = apng->width - 1, y1 = apng->height - 1;
+    if (dirty != NULL && apng->nb_frames > 0)
+    {
+        // an APNG frame cannot be empty: an unchanged frame repeats one pixel
+        x0 = MIN(MAX(dirty->x_min, 0), apng->width - 1);
+        y0 = MIN(MAX(dirty->y_min, 0), apng->height - 1);
+        x1 = MAX(MIN(dirty->x_max, apng->width - 1), x0);
+        y1 = MAX(MIN(dirty->y_max, apng->height - 1), y0);
+    }
+
+    // pixels of clean tiles are still those of the previous frame
+    for (int ty = y0 / DIRTY_TILE; ty <= y1 / DIRTY_TILE; ++ty)
+    {
+        for (int tx = x0 / DIRTY_TILE; tx <= x1 / DIRTY_TILE; ++tx)
+        {
+            if (apng->nb_frames == 0 || dirty_tile(dirty, tx, ty))
+                heightmap_to_pixels(heightmap, apng->width, MAX(tx * DIRTY_TILE, x0), MAX(ty * DIRTY_TILE, y0),
+                                    MIN((tx + 1) * DIRTY_TILE - 1, x1), MIN((ty + 1) * DIRTY_TILE - 1, y1), apng->format, apng->pixels);
+        }
+    }
+
+    unsigned char chunk[12 + 26];
+    unsigned char *o = chunk;
+    stbiw__wp32(o, 26);
+    stbiw__wptag(o, "fcTL");
+    stbiw__wp32(o, apng->sequence);
+    apng->sequence++;
+    stbiw__wp32(o, x1 - x0 + 1);
+    stbiw__wp32(o, y1 - y0 + 1);
+    stbiw__wp32(o, x0);
+    stbiw__wp32(o, y0);
+    *o++ = 0; // delay of 1 / 25 s
+    *o++ = 1;
+    *o++ = 0;
+    *o++ = 25;
+    *o++ = 0; // APNG_DISPOSE_OP_NONE
+    *o++ = 0; // APNG_BLEND_OP_SOURCE
+    stbiw__wpcrc(&o, 26);
+
+    int bpp = apng->format == IMAGE_RGB8 ? 3 : apng->format == IMAGE_GRAY16 ? 2 : 1;
+    const unsigned char *first = apng->pixels + ((long)y0 * apng->width + x0) * bpp;
+    int filter = apng->profile == PNG_ARCHIVAL ? -1 : 2;
+    int result = fwrite(chunk, 1, sizeof(chunk), apng->f) == sizeof(chunk)
+                 && write_png_data(apng->f, first, apng->width * bpp, x1 - x0 + 1, y1 - y0 + 1, bpp, filter,
+                                   png_profile_quality(apng->profile), apng->nb_frames > 0 ? &apng->sequence : NULL);
+    apng->nb_frames++;
+    if (!result)
+    {
+        printf("Error writing the frame %d of the animated image.\n", apng->nb_frames);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Writes the frame count and closes an animated PNG.
+ *
+ * @param apng The writer to close.
+ * @return int 0 if successful, -1 if there is an error.
+ */
+int apng_close(struct apng_writer *apng)
+{
+    int result = write_png_end(apng->f);
+    result = fseek(apng->f, apng->actl_offset, SEEK_SET) == 0 && write_apng_actl(apng->f, apng->nb_frames) && result;
+    result = fclose(apng->f) == 0 && result;
+    if (!result)
+        printf("Error writing the animated image.\n");
+    free(apng->pixels);
+    apng->f = NULL;
+    apng->pixels = NULL;
+    return result ? 0 : -1;
+}
+
+/**
+ * @brief Writes buffers at an offset of a file, retrying after partial writes.
+ *
+ * @param fd File descriptor.
+ * @param iov Buffers to write, consumed by the call.
+ * @param iovcnt Number of buffers.
+ * @param offset Offset of the first byte.
+ * @return int 1 if successful, 0 otherwise.
+ */
+static int write_all_at(int fd, struct iovec *iov, int iovcnt, off_t offset)
+{
+    size_t remaining = 0;
+    for (int i = 0; i < iovcnt; ++i)
+        remaining += iov[i].iov_len;
+
+    ssize_t written;
+    while (remaining > 0 && (written = pwritev(fd, iov, iovcnt, offset)) > 0)
+    {
+        remaining -= written;
+        offset += written;
+        for (int i = 0; i < iovcnt; ++i)
+        {
+            size_t step = MIN((size_t)written, iov[i].iov_len);
+            iov[i].iov_base = (char *)iov[i].iov_base + step;
+            iov[i].iov_len -= step;
+            written -= step;
+        }
+    }
+    return remaining == 0;
+}
+
+/**
+ * @brief Reads a block of a file at a given offset, looping over short reads.
+ *
+ * A single pread() returns at most about 2 GiB on Linux, less than a raw
+ * frame of a large terrain.
+ *
+ * @param fd File descriptor.
+ * @param data Destination.
+ * @param size Number of bytes to read.
+ * @param offset Offset of the first byte.
+ * @return int 1 if successful, 0 otherwise.
+ */
+static int read_all_at(int fd, void *data, uint64_t size, uint64_t offset)
+{
+    unsigned char *bytes = (unsigned char *)data;
+    ssize_t nb_read;
+    while (size > 0 && (nb_read = pread(fd, bytes, (size_t)size, (off_t)offset)) > 0)
+    {
+        bytes += nb_read;
+        size -= nb_read;
+        offset += nb_read;
+    }
+    return size == 0;
+}
+
+/**
+ * @brief Computes the CRC-32 of a frame payload.
+ *
+ * stbiw__crc32() takes an int length, so payloads of 2 GiB and more are
+ * checksummed in pieces combined with crc32_combine().
+ *
+ * @param payload The payload.
+ * @param size Size of the payload.
+ * @return uint32_t CRC-32 of the payload.
+ */
+static uint32_t archive_crc32(const unsigned char *payload, uint64_t size)
+{
+    const uint64_t piece = 1u << 30;
+    uint32_t crc = stbiw__crc32((unsigned char *)payload, (int)MIN(size, piece));
+    for (uint64_t done = MIN(size, piece); done < size; done += piece)
+    {
+        uint64_t len = MIN(size - done, piece);
+        crc = crc32_combine(crc, stbiw__crc32((unsigned char *)payload + done, (int)len), len);
+    }
+    return crc;
+}
+
+/**
+ * @brief Adds a frame to the in-memory index of an archive.
+ *
+ * @param archive The archive, locked by the caller.
+ * @param entry The entry to add.
+ * @return int Index of the entry, -1 on allocation error.
+ */
+static int archive_add_entry(struct frame_archive *archive, struct archive_entry entry)
+{
+    if (archive->count == archive->capacity)
+    {
+        int capacity = MAX(2 * archive->capacity, 64);
+        struct archive_entry *entries = (struct archive_entry *)realloc(archive->entries, capacity * sizeof(struct archive_entry));
+        if (entries == NULL)
+            return -1;
+        archive->entries = entries;
+        archive->capacity = capacity;
+    }
+    archive->entries[archive->count] = entry;
+    return archive->count++;
+}
+
+/**
+ * @brief Rebuilds the index of an archive closed without one by scanning its frames.
+ *
+ * Frames are read from archive->end until the file ends, a frame header is
+ * invalid or a payload does not match its CRC: everything after the last
+ * complete frame is overwritten by the next appends.
+ *
+ * @param archive The archive.
+ * @param size Size of the archive file.
+ */
+static void archive_recover(struct frame_archive *archive, uint64_t size)
+{
+    uint64_t offset = archive->end;
+    struct archive_frame frame;
+    while (offset + sizeof(frame) <= size && pread(archive->fd, &frame, sizeof(frame), offset) == sizeof(frame)
+           && memcmp(frame.magic, "FRAM", 4) == 0 && frame.size <= size - offset - sizeof(frame))
+    {
+        unsigned char *payload = (unsigned char *)malloc(MAX(frame.size, 1));
+        int valid = payload != NULL && read_all_at(archive->fd, payload, frame.size, offset + sizeof(frame))
+                    && archive_crc32(payload, frame.size) == frame.crc;
+        free(payload);
+        if (!valid)
+            break;
+
+        struct archive_entry entry = {offset + sizeof(frame), frame.size, frame.run_id, frame.nb_drop};
+        if (archive_add_entry(archive, entry) < 0)
+            break;
+        offset += sizeof(frame) + frame.size;
+    }
+    archive->end = offset;
+    printf("Archive index rebuilt: %d frames recovered\n", archive->count);
+}
+
+/**
+ * @brief Opens a sweep archive for appending, creating it if needed, or for reading.
+ *
+ * An archive holds every snapshot of a sweep in one file: an archive_header,
+ * then frames made of an archive_frame header and a payload (a PNG file or a
+ * raw snapshot, as save_heightmap_as_image() would write it, or a residual
+ * frame, see write_residual_frame()), then the index
+ * of the frames and an archive_footer pointing to it. A single file means a
+ * single create and open for the whole sweep instead of one per snapshot.
+ *
+ * The index is only written on close. When reopening, it is loaded and
+ * truncated from the file, and a new one is written on the next close. When
+ * there is no valid footer, the index is rebuilt from the frame headers.
+ * An archive opened for reading is never written to, not even on close, so
+ * other processes can read the same file.
+ *
+ * @param archive The archive to open.
+ * @param filename Name of the archive file.
+ * @param width Width of the frames, 0 to take it from an existing archive.
+ * @param height Height of the frames, 0 to take it from an existing archive.
+ * @param options Format and profile of the frames, an existing archive of
+ * another format or profile is refused. NULL for RUN_OPTIONS_DEFAULT on new
+ * archives and whatever an existing archive holds.
+ * @param read_only 1 to open an existing archive for reading, 0 for appending.
+ * @return int 0 if successful, -1 if there is an error.
+ */
+static int archive_open_mode(struct frame_archive *archive, const char *filename, int width, int height, const struct run_options *options, int read_only)
+{
+    struct run_options default_options = RUN_OPTIONS_DEFAULT;
+    int check_format = options != NULL;
+    if (options == NULL)
+        options = &default_options;
+
+    memset(archive, 0, sizeof(*archive));
+    archive->read_only = read_only;
+    archive->fd = read_only ? open(filename, O_RDONLY) : open(filename, O_RDWR | O_CREAT, 0644);
+    struct stat st;
+    if (archive->fd < 0 || fstat(archive->fd, &st) != 0)
+    {
+        printf("Error opening the archive: %s\n", filename);
+        if (archive->fd >= 0)
+            close(archive->fd);
+        return -1;
+    }
+
+    struct archive_header header = {{'H', 'A', 'R', 'C'}, 1, (uint32_t)width, (uint32_t)height, (uint32_t)options->format, (uint32_t)options->profile};
+    uint64_t size = (uint64_t)st.st_size;
+    if (size == 0)
+    {
+        struct iovec iov = {&header, sizeof(header)};
+        if (read_only || width <= 0 || height <= 0 || !write_all_at(archive->fd, &iov, 1, 0))
+        {
+            printf("Error creating the archive: %s\n", filename);
+            close(archive->fd);
+            return -1;
+        }
+    }
+    else if (pread(archive->fd, &header, sizeof(header), 0) != sizeof(header) || memcmp(header.magic, "HARC", 4) != 0 || header.version != 1
+             || (width > 0 && (header.width != (uint32_t)width || header.height != (uint32_t)height)))
+    {
+        printf("Invalid archive or frame size: %s\n", filename);
+        close(archive->fd);
+        return -1;
+    }
+    else if (check_format && (header.format != (uint32_t)options->format || header.profile != (uint32_t)options->profile))
+    {
+        // frames of another format would not decode like the others
+        printf("Error: the archive %s holds frames of another format or profile.\n", filename);
+        close(archive->fd);
+        return -1;
+    }
+    archive->width = (int)header.width;
+    archive->height = (int)header.height;
+    archive->format = (enum image_format)header.format;
+    archive->profile = (enum png_profile)header.profile;
+    archive->end = sizeof(header);
+
+    // load the index when the footer is intact, rebuild it otherwise
+    struct archive_footer footer;
+    if (size > sizeof(header))
+    {
+        int indexed = size >= sizeof(header) + sizeof(footer)
+                      && pread(archive->fd, &footer, sizeof(footer), size - sizeof(footer)) == sizeof(footer)
+                      && memcmp(footer.magic, "HIDX", 4) == 0
+                      && footer.index_offset >= sizeof(header)
+                      && footer.index_offset + (uint64_t)footer.count * sizeof(struct archive_entry) + sizeof(footer) == size;
+        if (indexed)
+        {
+            archive->entries = (struct archive_entry *)malloc(MAX(footer.count, 1) * sizeof(struct archive_entry));
+            size_t index_size = (size_t)footer.count * sizeof(struct archive_entry);
+            indexed = archive->entries != NULL && pread(archive->fd, archive->entries, index_size, footer.index_offset) == (ssize_t)index_size;
+        }
+        if (indexed)
+        {
+            // drop the index from the file: if the next close does not happen, recovery scans the frames instead of trusting a stale footer
+            archive->count = archive->capacity = (int)footer.count;
+            archive->end = footer.index_offset;
+            if (!read_only && ftruncate(archive->fd, (off_t)footer.index_offset) != 0)
+            {
+                printf("Error truncating the archive index: %s\n", filename);
+                free(archive->entries);
+                close(archive->fd);
+                return -1;
+            }
+        }
+        else
+        {
+            free(archive->entries);
+            archive->entries = NULL;
+            archive_recover(archive, size);
+        }
+    }
+
+    pthread_mutex_init(&archive->lock, NULL);
+    return 0;
+}
+
+int archive_open(struct frame_archive *archive, const char *filename, int width, int height, const struct run_options *options)
+{
+    return archive_open_mode(archive, filename, width, height, options, 0);
+}
+
+int archive_open_read(struct frame_archive *archive, const char *filename, int width, int height)
+{
+    return archive_open_mode(archive, filename, width, height, NULL, 1);
+}
+
+/**
+ * @brief Appends an encoded frame to an archive.
+ *
+ * @param archive The archive.
+ * @param run_id Run the frame belongs to.
+ * @param nb_drop Number of drops simulated before the frame.
+ * @param payload Encoded frame, as returned by archive_read_frame().
+ * @param size Size of the payload.
+ * @return int 0 if successful, -1 if there is an error.
+ */
+static int archive_append_payload(struct frame_archive *archive, int run_id, int nb_drop, const void *payload, size_t size)
+{
+    struct archive_frame frame = {{'F', 'R', 'A', 'M'}, (uint32_t)run_id, (uint32_t)nb_drop, archive_crc32((const unsigned char *)payload, size), size};
+    pthread_mutex_lock(&archive->lock);
+    uint64_t offset = archive->end;
+    struct archive_entry entry = {offset + sizeof(frame), size, (uint32_t)run_id, (uint32_t)nb_drop};
+    int index = archive_add_entry(archive, entry);
+    if (index >= 0)
+        archive->end += sizeof(frame) + size;
+    pthread_mutex_unlock(&archive->lock);
+
+    struct iovec iov[2] = {{&frame, sizeof(frame)}, {(void *)payload, size}};
+    int result = index >= 0 && write_all_at(archive->fd, iov, 2, (off_t)offset);
+    if (!result)
+    {
+        printf("Error writing the frame %d of run %d.\n", nb_drop, run_id);
+        if (index >= 0)
+        {
+            // keep the reserved bytes but hide the frame
+            pthread_mutex_lock(&archive->lock);
+            archive->entries[index].run_id = UINT32_MAX;
+            pthread_mutex_unlock(&archive->lock);
+        }
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Encodes a heightmap and appends it as a frame.
+ *
+ * The frame is encoded in memory without holding the lock, so several runs
+ * can compress in parallel. Only the reservation of its place at the end of
+ * the file is serialized; the write itself is a positioned pwritev().
+ *
+ * @param archive The archive.
+ * @param run_id Run the frame belongs to.
+ * @param nb_drop Number of drops simulated before the frame.
+ * @param heightmap Row-major heightmap of archive->width * archive->height values.
+ * @param keyframe_interval Frames from one keyframe to the next, see encode_heightmap().
+ * @param delta Previous frame of the run, updated; NULL for a complete frame.
+ * @param dirty Cells written since the previous frame, NULL for all of them.
+ * @return int 0 if successful, -1 if there is an error.
+ */
+static int archive_append_frame(struct frame_archive *archive, int run_id, int nb_drop, const double *heightmap, int keyframe_interval, struct delta_state *delta, const struct dirty_tracker *dirty)
+{
+    char *payload = NULL;
+    size_t size = 0;
+    struct run_options options = {.format = archive->format, .profile = archive->profile, .keyframe_interval = keyframe_interval};
+    FILE *f = open_memstream(&payload, &size);
+    int result = f != NULL && encode_heightmap(f, archive->width, archive->height, heightmap, &options, delta, dirty, nb_drop);
+    result = f != NULL && fclose(f) == 0 && result;
+    if (!result)
+    {
+        printf("Error encoding the frame %d of run %d.\n", nb_drop, run_id);
+        free(payload);
+        return -1;
+    }
+
+    result = archive_append_payload(archive, run_id, nb_drop, payload, size) == 0;
+    free(payload);
+    return result ? 0 : -1;
+}
+
+/**
+ * @brief Encodes a heightmap and appends it as a complete frame.
+ *
+ * @param archive The archive.
+ * @param run_id Run the frame belongs to.
+ * @param nb_drop Number of drops simulated before the frame.
+ * @param heightmap Row-major heightmap of archive->width * archive->height values.
+ * @return int 0 if successful, -1 if there is an error.
+ */
+int archive_append(struct frame_archive *archive, int run_id, int nb_drop, const double *heightmap)
+{
+    return archive_append_frame(archive, run_id, nb_drop, heightmap, 0, NULL, NULL);
+}
+
+/**
+ * @brief Finds a frame in the index. The last frame appended wins when a run is appended twice.
+ *
+ * @param archive The archive.
+ * @param run_id Run of the frame.
+ * @param nb_drop Drop count of the frame.
+ * @return int Index of the frame, -1 if it is not in the archive.
+ */
+int archive_find(struct frame_archive *archive, int run_id, int nb_drop)
+{
+    int found = -1;
+    pthread_mutex_lock(&archive->lock);
+    for (int i = archive->count - 1; i >= 0 && found < 0; --i)
+    {
+        if (archive->entries[i].run_id == (uint32_t)run_id && archive->entries[i].nb_drop == (uint32_t)nb_drop)
+            found = i;
+    }
+    pthread_mutex_unlock(&archive->lock);
+    return found;
+}
+
+/**
+ * @brief Finds the drop count of the last frame of a run in an archive.
+ *
+ * @param archive The archive.
+ * @param run_id The run.
+ * @param last_drop Set to the drop count of the last frame of the run, 0 without frames.
+ * @return int Number of frames of the run.
+ */
+static int archive_run_last_drop(struct frame_archive *archive, int run_id, int *last_drop)
+{
+    int nb_frames = 0;
+    *last_drop = 0;
+    pthread_mutex_lock(&archive->lock);
+    for (int i = 0; i < archive->count; ++i)
+    {
+        const struct archive_entry *entry = &archive->entries[i];
+        if (entry->run_id != (uint32_t)run_id)
+            continue;
+        *last_drop = MAX(*last_drop, (int)entry->nb_drop);
+        ++nb_frames;
+    }
+    pthread_mutex_unlock(&archive->lock);
+    return nb_frames;
+}
+
+/**
+ * @brief Reads the payload of a frame with positioned reads, see read_all_at().
+ *
+ * @param archive The archive.
+ * @param index Index of the frame.
+ * @param size Set to the size of the payload.
+ * @return unsigned char* The payload, to free, NULL if there is an error.
+ */
+unsigned char *archive_read_frame(struct frame_archive *archive, int index, size_t *size)
+{
+    pthread_mutex_lock(&archive->lock);
+    int valid = index >= 0 && index < archive->count;
+    struct archive_entry entry = valid ? archive->entries[index] : (struct archive_entry){0};
+    pthread_mutex_unlock(&archive->lock);
+    if (!valid)
+        return NULL;
+
+    unsigned char *payload = (unsigned char *)malloc(MAX(entry.size, 1));
+    if (payload == NULL || !read_all_at(archive->fd, payload, entry.size, entry.offset))
+    {
+        printf("Error reading the frame %d.\n", index);
+        free(payload);
+        return NULL;
+    }
+    *size = entry.size;
+    return payload;
+}
+
+/**
+ * @brief Decodes a frame of an archive to its samples, see archive_decode_frame().
+ *
+ * A residual frame is decoded by decoding first the frame of the same run it
+ * refers to, the last one appended before it with the reference drop count,
+ * and so on back to the keyframe.
+ *
+ * @param archive The archive.
+ * @param index Index of the frame.
+ * @param size Set to the size of the samples.
+ * @param keyframe_drop Set to the drop count of the keyframe the frame was decoded from.
+ * @return unsigned char* The samples, to free, NULL if there is an error.
+ */
+static unsigned char *archive_decode_chain(struct frame_archive *archive, int index, size_t *size, uint32_t *keyframe_drop)
+{
+    size_t payload_size;
+    unsigned char *payload = archive_read_frame(archive, index, &payload_size);
+    if (payload == NULL)
+        return NULL;
+
+    unsigned char *samples = NULL;
+    struct raw_header raw;
+    if (payload_size >= sizeof(raw) && memcmp(payload, "HMAP", 4) == 0)
+    {
+        // raw snapshots are always complete
+        memcpy(&raw, payload, sizeof(raw));
+        if (raw.header_size <= payload_size)
+        {
+            *size = payload_size - raw.header_size;
+            memmove(payload, payload + raw.header_size, *size);
+            samples = payload;
+            payload = NULL;
+        }
+    }
+    else if (payload_size >= 4 && memcmp(payload, "HRES", 4) == 0)
+    {
+        struct residual_header header;
+        int reference = -1;
+        memset(&header, 0, sizeof(header));
+        memcpy(&header, payload, MIN(payload_size, sizeof(header)));
+        pthread_mutex_lock(&archive->lock);
+        uint32_t run_id = archive->entries[index].run_id;
+        for (int i = index - 1; i >= 0 && reference < 0; --i)
+        {
+            if (archive->entries[i].run_id == run_id && archive->entries[i].nb_drop == header.reference_drop)
+                reference = i;
+        }
+        pthread_mutex_unlock(&archive->lock);
+
+        uint32_t reference_keyframe = 0;
+        samples = reference >= 0 ? archive_decode_chain(archive, reference, size, &reference_keyframe) : NULL;
+        if (samples != NULL && (reference_keyframe != header.keyframe_drop || !apply_residual_frame(payload, payload_size, archive->width, archive->height, archive->format, samples)))
+        {
+            free(samples);
+            samples = NULL;
+        }
+        *keyframe_drop = header.keyframe_drop;
+    }
+    else
+    {
+        int width = 0, height = 0, channels = 0, bit_depth = 0;
+        samples = read_png(payload, payload_size, &width, &height, &channels, &bit_depth);
+        if (samples != NULL && (width != archive->width || height != archive->height || channels != (archive->format == IMAGE_RGB8 ? 3 : 1)
+                                || bit_depth != (archive->format == IMAGE_GRAY16 ? 16 : 8)))
+        {
+            free(samples);
+            samples = NULL;
+        }
+        *size = (size_t)width * height * channels * bit_depth / 8;
+        pthread_mutex_lock(&archive->lock);
+        *keyframe_drop = archive->entries[index].nb_drop;
+        pthread_mutex_unlock(&archive->lock);
+    }
+    free(payload);
+    return samples;
+}
+
+/**
+ * @brief Decodes a frame of an archive to its samples, residual frames included.
+ *
+ * @param archive The archive.
+ * @param index Index of the frame.
+ * @param size Set to the size of the samples.
+ * @return unsigned char* The samples, to free, NULL if there is an error.
+ */
+unsigned char *archive_decode_frame(struct frame_archive *archive, int index, size_t *size)
+{
+    uint32_t keyframe_drop;
+    unsigned char *samples = archive_decode_chain(archive, index, size, &keyframe_drop);
+    if (samples == NULL)
+        printf("Error decoding the frame %d.\n", index);
+    return samples;
+}
+
+/**
+ * @brief Collects the index entries of a run.
+ *
+ * @param archive The archive.
+ * @param run_id The run.
+ * @param indices Set to the indices of its frames, in append order, to free.
+ * @return int Number of frames of the run, -1 on allocation error.
+ */
+static int archive_run_frames(struct frame_archive *archive, int run_id, int **indices)
+{
+    int count = 0;
+    pthread_mutex_lock(&archive->lock);
+    *indices = (int *)malloc(MAX(archive->count, 1) * sizeof(int));
+    for (int i = 0; *indices != NULL && i < archive->count; ++i)
+    {
+        if (archive->entries[i].run_id == (uint32_t)run_id)
+            (*indices)[count++] = i;
+    }
+    pthread_mutex_unlock(&archive->lock);
+    return *indices != NULL ? count : -1;
+}
+
+int archive_copy_run(struct frame_archive *dst, int dst_run_id, struct frame_archive *src, int src_run_id)
+{
+    int *indices;
+    int count = archive_run_frames(src, src_run_id, &indices);
+    if (count < 0 || dst->width != src->width || dst->height != src->height || dst->format != src->format)
+    {
+        free(indices);
+        return -1;
+    }
+
+    for (int i = 0; i < count; ++i)
+    {
+        size_t size;
+        unsigned char *payload = archive_read_frame(src, indices[i], &size);
+        pthread_mutex_lock(&src->lock);
+        int nb_drop = (int)src->entries[indices[i]].nb_drop;
+        pthread_mutex_unlock(&src->lock);
+        int result = payload != NULL && archive_append_payload(dst, dst_run_id, nb_drop, payload, size) == 0;
+        free(payload);
+        if (!result)
+        {
+            free(indices);
+            return -1;
+        }
+    }
+    free(indices);
+    return count;
+}
+
+int archive_alias_run(struct frame_archive *archive, int run_id, int source_run_id)
+{
+    int *indices;
+    int count = archive_run_frames(archive, source_run_id, &indices);
+    pthread_mutex_lock(&archive->lock);
+    for (int i = 0; i < count; ++i)
+    {
+        struct archive_entry entry = archive->entries[indices[i]];
+        entry.run_id = (uint32_t)run_id;
+        if (archive_add_entry(archive, entry) < 0)
+        {
+            count = -1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&archive->lock);
+    free(indices);
+    return count;
+}
+
+/**
+ * @brief Writes the index and the footer at the end of the archive and closes it.
+ *
+ * No frame may be appended while the archive is closed. An archive opened
+ * for reading is closed as it is.
+ *
+ * @param archive The archive to close.
+ * @return int 0 if successful, -1 if there is an error.
+ */
+int archive_close(struct frame_archive *archive)
+{
+    if (archive->read_only)
+    {
+        // the file is left as it was found
+        int result = close(archive->fd) == 0;
+        pthread_mutex_destroy(&archive->lock);
+        free(archive->entries);
+        archive->entries = NULL;
+        archive->count = archive->capacity = 0;
+        return result ? 0 : -1;
+    }
+
+    struct archive_footer footer = {archive->end, (uint32_t)archive->count, {'H', 'I', 'D', 'X'}};
+    struct iovec iov[2] = {{archive->entries, archive->count * sizeof(struct archive_entry)}, {&footer, sizeof(footer)}};
+    off_t end = (off_t)(archive->end + iov[0].iov_len + iov[1].iov_len);
+    int result = write_all_at(archive->fd, iov, 2, (off_t)archive->end) && ftruncate(archive->fd, end) == 0;
+    result = close(archive->fd) == 0 && result;
+    if (result)
+        printf("Archive closed: %d frames, %.1f MB\n", archive->count, end / 1e6);
+    else
+        printf("Error writing the archive index.\n");
+
+    pthread_mutex_destroy(&archive->lock);
+    free(archive->entries);
+    archive->entries = NULL;
+    archive->count = archive->capacity = 0;
+    return result ? 0 : -1;
+}
+
+/**
+ * @brief Mixes a block of bytes into a 64-bit FNV-1a hash.
+ *
+ * @param hash Hash so far.
+ * @param data Bytes to mix.
+ * @param size Number of bytes.
+ * @return uint64_t The updated hash.
+ */
+static uint64_t fnv1a64(uint64_t hash, const void *data, size_t size)
+{
+    const unsigned char *bytes = (const unsigned char *)data;
+    for (size_t i = 0; i < size; ++i)
+    {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+uint64_t sweep_run_key(const struct parameters *param, int nb_drop, int save_every)
+{
+    // field by field, the padding of the struct is not initialized
+    double values[] = {param->inertia, param->slope, param->capacity, param->deposition,
+                       param->erosion, param->gravity, param->evaporation};
+    int32_t integers[] = {param->radius, nb_drop, save_every};
+    uint64_t hash = fnv1a64(0xcbf29ce484222325ull, values, sizeof(values));
+    return fnv1a64(hash, integers, sizeof(integers));
+}
+
+/**
+ * @brief Appends one record to a journal with a single write().
+ *
+ * The journal is opened with O_APPEND, so records of concurrent runs never
+ * interleave; a record torn by a crash is the last line and is ignored on resume.
+ *
+ * @param journal The journal.
+ * @param record The record, ending with a newline.
+ */
+static void journal_write(struct sweep_journal *journal, const char *record)
+{
+    size_t len = strlen(record);
+    if (write(journal->fd, record, len) != (ssize_t)len)
+        printf("Error writing the sweep journal: %s\n", strerror(errno));
+}
+
+/**
+ * @brief Builds the path of the checkpoint of a run.
+ *
+ * @param journal The journal.
+ * @param run_id The run.
+ * @param suffix Appended to the name, "" or ".tmp".
+ * @param path Destination of the path.
+ * @param size Size of the destination.
+ */
+static void checkpoint_path(const struct sweep_journal *journal, int run_id, const char *suffix, char *path, size_t size)
+{
+    snprintf(path, size, "%s/checkpoints/run_%d.hmap%s", journal->directory, run_id, suffix);
+}
+
+int journal_open(struct sweep_journal *journal, const char *directory, int width, int height, int nb_runs, const uint64_t *keys, int checkpoint_every, int resume, unsigned int *seed)
+{
+    char path[1100];
+    memset(journal, 0, sizeof(*journal));
+    snprintf(journal->directory, sizeof(journal->directory), "%s", directory);
+    journal->width = width;
+    journal->height = height;
+    journal->checkpoint_every = checkpoint_every;
+    journal->nb_runs = nb_runs;
+    journal->keys = (uint64_t *)malloc(MAX(nb_runs, 1) * sizeof(uint64_t));
+    journal->checkpoints = (int *)calloc(MAX(nb_runs, 1), sizeof(int));
+    journal->done = (unsigned char *)calloc(MAX(nb_runs, 1), 1);
+    snprintf(path, sizeof(path), "%s/checkpoints", directory);
+    if (journal->keys == NULL || journal->checkpoints == NULL || journal->done == NULL || create_directories(path) != 0)
+    {
+        printf("Error preparing the sweep journal in %s.\n", directory);
+        goto error;
+    }
+    memcpy(journal->keys, keys, nb_runs * sizeof(uint64_t));
+
+    // read back the records of the runs that kept their configuration
+    int resumed = 0;
+    snprintf(path, sizeof(path), "%s/sweep.journal", directory);
+    FILE *f = resume ? fopen(path, "r") : NULL;
+    if (f != NULL)
+    {
+        char line[256];
+        unsigned int recorded_seed;
+        int recorded_width, recorded_height;
+        if (fgets(line, sizeof(line), f) != NULL && sscanf(line, "sweep %u %d %d", &recorded_seed, &recorded_width, &recorded_height) == 3 &&
+            recorded_width == width && recorded_height == height && (*seed == 0 || *seed == recorded_seed))
+        {
+            resumed = 1;
+            *seed = recorded_seed;
+            while (fgets(line, sizeof(line), f) != NULL)
+            {
+                int run_id, nb_drop;
+                unsigned long long key;
+                if (strchr(line, '\n') == NULL)
+                    break; // torn by a crash
+                if (sscanf(line, "checkpoint %d %llx %d", &run_id, &key, &nb_drop) == 3 && run_id >= 1 && run_id <= nb_runs &&
+                    key == journal->keys[run_id - 1])
+                    journal->checkpoints[run_id - 1] = MAX(journal->checkpoints[run_id - 1], nb_drop);
+                else if (sscanf(line, "done %d %llx", &run_id, &key) == 2 && run_id >= 1 && run_id <= nb_runs &&
+                         key == journal->keys[run_id - 1])
+                    journal->done[run_id - 1] = 1;
+            }
+        }
+        else
+            printf("The sweep journal %s does not match the sweep, starting over.\n", path);
+        fclose(f);
+    }
+
+    journal->fd = open(path, O_WRONLY | O_CREAT | O_APPEND | (resumed ? 0 : O_TRUNC), 0644);
+    if (journal->fd < 0)
+    {
+        printf("Error opening the sweep journal %s: %s\n", path, strerror(errno));
+        goto error;
+    }
+    if (!resumed)
+    {
+        char record[64];
+        if (*seed == 0)
+            *seed = MAX((unsigned int)rand(), 1u); // 0 would draw a seed per run
+        snprintf(record, sizeof(record), "sweep %u %d %d\n", *seed, width, height);
+        journal_write(journal, record);
+    }
+    pthread_mutex_init(&journal->lock, NULL);
+    return resumed;
+
+error:
+    free(journal->keys);
+    free(journal->checkpoints);
+    free(journal->done);
+    journal->keys = NULL;
+    journal->checkpoints = NULL;
+    journal->done = NULL;
+    return -1;
+}
+
+void journal_checkpoint(struct sweep_journal *journal, int run_id, int nb_drop, const double *heightmap)
+{
+    if (journal->checkpoint_every <= 0 || run_id < 1 || run_id > journal->nb_runs)
+        return;
+    pthread_mutex_lock(&journal->lock);
+    int due = nb_drop - journal->checkpoints[run_id - 1] >= journal->checkpoint_every;
+    pthread_mutex_unlock(&journal->lock);
+    if (!due)
+        return;
+
+    // written aside then renamed: the previous checkpoint stays valid until the new one is complete
+    char tmp[1200], path[1200], record[128];
+    checkpoint_path(journal, run_id, ".tmp", tmp, sizeof(tmp));
+    checkpoint_path(journal, run_id, "", path, sizeof(path));
+    if (!save_heightmap_raw(journal->width, journal->height, heightmap, tmp, RAW_F64) || rename(tmp, path) != 0)
+    {
+        printf("Error saving the checkpoint %s.\n", path);
+        return;
+    }
+
+    pthread_mutex_lock(&journal->lock);
+    journal->checkpoints[run_id - 1] = nb_drop;
+    pthread_mutex_unlock(&journal->lock);
+    snprintf(record, sizeof(record), "checkpoint %d %016llx %d\n", run_id, (unsigned long long)journal->keys[run_id - 1], nb_drop);
+    journal_write(journal, record);
+}
+
+void journal_done(struct sweep_journal *journal, int run_id, int last_drop)
+{
+    char record[128], path[1200];
+    snprintf(record, sizeof(record), "done %d %016llx %d\n", run_id, (unsigned long long)journal->keys[run_id - 1], last_drop);
+    journal_write(journal, record);
+
+    pthread_mutex_lock(&journal->lock);
+    journal->done[run_id - 1] = 1;
+    pthread_mutex_unlock(&journal->lock);
+    checkpoint_path(journal, run_id, "", path, sizeof(path));
+    unlink(path);
+}
+
+void journal_close(struct sweep_journal *journal)
+{
+    close(journal->fd);
+    pthread_mutex_destroy(&journal->lock);
+    free(journal->keys);
+    free(journal->checkpoints);
+    free(journal->done);
+    journal->keys = NULL;
+    journal->checkpoints = NULL;
+    journal->done = NULL;
+}
+
+/**
+ * @brief Thread entry point of a snapshot writer: saves queued snapshots until closed.
+ *
+ * @param arg The snapshot writer.
+ */
+static void *snapshot_writer_main(void *arg)
+{
+    struct snapshot_writer *writer = (struct snapshot_writer *)arg;
+    pthread_mutex_lock(&writer->lock);
+    while (1)
+    {
+        while (writer->count == 0 && !writer->closing)
+            pthread_cond_wait(&writer->not_empty, &writer->lock);
+        if (writer->count == 0)
+            break;
+
+        // the buffer stays owned by the queue until it is written
+        struct snapshot_job *job = &writer->jobs[writer->first];
+        pthread_mutex_unlock(&writer->lock);
+        if (writer->options.metrics != NULL)
+            metrics_record(writer->options.metrics, writer->options.run_id, job->nb_drop, job->heightmap);
+        if (!writer->options.metrics_only)
+        {
+            if (writer->options.archive != NULL)
+                archive_append_frame(writer->options.archive, writer->options.run_id, job->nb_drop, job->heightmap, writer->options.keyframe_interval, &writer->delta, &job->dirty);
+            else if (writer->options.animated)
+            {
+                if (writer->apng.f != NULL || apng_open(&writer->apng, job->filename, writer->width, writer->height, &writer->options) == 0)
+                    apng_write_frame(&writer->apng, job->heightmap, &job->dirty);
+            }
+            else
+                save_heightmap_as_image(writer->width, writer->height, (double(*)[writer->height])job->heightmap, job->filename, &writer->options);
+        }
+        // after the frame: a run resumed from this checkpoint has its frames up to here
+        if (writer->options.journal != NULL)
+            journal_checkpoint(writer->options.journal, writer->options.run_id, job->nb_drop, job->heightmap);
+        pthread_mutex_lock(&writer->lock);
+
+        writer->first = (writer->first + 1) % SNAPSHOT_BUFFERS;
+        writer->count--;
+        pthread_cond_signal(&writer->not_full);
+    }
+    pthread_mutex_unlock(&writer->lock);
+    return NULL;
+}
+
+/**
+ * @brief Starts a background thread writing heightmap snapshots.
+ *
+ * The writer owns SNAPSHOT_BUFFERS heightmap buffers used as a bounded queue:
+ * the simulation only pays for a copy while the thread quantizes, compresses
+ * and writes the previous snapshot. It also keeps the samples of the last
+ * snapshot written, the reference of the next residual frame.
+ *
+ * @param writer The writer to start.
+ * @param width Width of the heightmap.
+ * @param height Height of the heightmap.
+ * @param options Output options of the snapshots.
+ * @return int 0 if successful, -1 if there is an error.
+ */
+int snapshot_writer_start(struct snapshot_writer *writer, int width, int height, const struct run_options *options)
+{
+    writer->width = width;
+    writer->height = height;
+    writer->options = *options;
+    writer->first = 0;
+    writer->count = 0;
+    writer->closing = 0;
+    writer->nb_snapshots = 0;
+    writer->nb_stalls = 0;
+    writer->stall_time = 0.0;
+    memset(&writer->delta, 0, sizeof(writer->delta));
+    memset(&writer->apng, 0, sizeof(writer->apng));
+    for (int i = 0; i < SNAPSHOT_BUFFERS; ++i)
+    {
+        writer->jobs[i].heightmap = (double *)malloc((size_t)width * height * sizeof(double));
+        if (writer->jobs[i].heightmap == NULL)
+        {
+            printf("Memory allocation error for the snapshot buffers.\n");
+            for (int j = 0; j < i; ++j)
+            {
+                free(writer->jobs[j].heightmap);
+                dirty_free(&writer->jobs[j].dirty);
+            }
+            return -1;
+        }
+        dirty_init(&writer->jobs[i].dirty, width, height);
+    }
+
+    pthread_mutex_init(&writer->lock, NULL);
+    pthread_cond_init(&writer->not_empty, NULL);
+    pthread_cond_init(&writer->not_full, NULL);
+    if (pthread_create(&writer->thread, NULL, snapshot_writer_main, writer) != 0)
+    {
+        printf("Error starting the snapshot writer thread.\n");
+        pthread_mutex_destroy(&writer->lock);
+        pthread_cond_destroy(&writer->not_empty);
+        pthread_cond_destroy(&writer->not_full);
+        for (int i = 0; i < SNAPSHOT_BUFFERS; ++i)
+        {
+            free(writer->jobs[i].heightmap);
+            dirty_free(&writer->jobs[i].dirty);
+        }
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Copies the heightmap into a free snapshot buffer and queues it.
+ *
+ * When every buffer is still waiting to be written, the simulation blocks
+ * until one is released; these stalls are counted and reported on stop.
+ *
+ * @param writer The writer.
+ * @param heightmap Heightmap to save.
+ * @param filename Destination of the snapshot.
+ * @param nb_drop Number of drops simulated before the snapshot.
+ * @param dirty Cells written since the previous snapshot, NULL for all of them.
+ */
+void snapshot_writer_submit(struct snapshot_writer *writer, const double *heightmap, const char *filename, int nb_drop, const struct dirty_tracker *dirty)
+{
+    pthread_mutex_lock(&writer->lock);
+    if (writer->count == SNAPSHOT_BUFFERS)
+    {
+        double start = get_time();
+        while (writer->count == SNAPSHOT_BUFFERS)
+            pthread_cond_wait(&writer->not_full, &writer->lock);
+        writer->nb_stalls++;
+        writer->stall_time += get_time() - start;
+    }
+    struct snapshot_job *job = &writer->jobs[(writer->first + writer->count) % SNAPSHOT_BUFFERS];
+    pthread_mutex_unlock(&writer->lock);
+
+    // only the writer thread reads queued buffers, this one is free
+    memcpy(job->heightmap, heightmap, (size_t)writer->width * writer->height * sizeof(double));
+    snprintf(job->filename, sizeof(job->filename), "%s", filename);
+    job->nb_drop = nb_drop;
+    dirty_copy(&job->dirty, dirty, writer->width, writer->height);
+
+    pthread_mutex_lock(&writer->lock);
+    writer->count++;
+    writer->nb_snapshots++;
+    pthread_cond_signal(&writer->not_empty);
+    pthread_mutex_unlock(&writer->lock);
+}
+
+/**
+ * @brief Writes the remaining snapshots, stops the thread and reports backpressure.
+ *
+ * @param writer The writer to stop.
+ */
+void snapshot_writer_stop(struct snapshot_writer *writer)
+{
+    pthread_mutex_lock(&writer->lock);
+    writer->closing = 1;
+    pthread_cond_signal(&writer->not_empty);
+    pthread_mutex_unlock(&writer->lock);
+    pthread_join(writer->thread, NULL);
+
+    if (writer->nb_stalls > 0)
+    {
+        printf("Snapshot writer could not keep up: %d of %d snapshots waited for a buffer (%.3f s)\n",
+               writer->nb_stalls, writer->nb_snapshots, writer->stall_time);
+    }
+
+    pthread_mutex_destroy(&writer->lock);
+    pthread_cond_destroy(&writer->not_empty);
+    pthread_cond_destroy(&writer->not_full);
+    for (int i = 0; i < SNAPSHOT_BUFFERS; ++i)
+    {
+        free(writer->jobs[i].heightmap);
+        dirty_free(&writer->jobs[i].dirty);
+    }
+    free(writer->delta.reference);
+    if (writer->apng.f != NULL)
+        apng_close(&writer->apng);
+}
+
+/**
+ * @brief Initializes the random number generator using the current time.
+ */
+void random_init()
+{
+    srand(time(NULL)); // Initialize random seed with current time
+}
+
+/**
+ * @brief PCG hash function for generating a pseudo-random value.
+ *
+ * @param input Input value to hash.
+ * @return uint32_t Pseudo-random hash.
+ */
+static uint32_t PCG_Hash(uint32_t input)
+{
+    uint32_t state = input * 747796405u + 2891336453u;
+    uint32_t word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+    return (word >> 22u) ^ word;
+}
+
+/**
+ * @brief Generates a random double between 0 and 1.
+ *
+ * @param seed Seed for random number generation.
+ * @return double Random double in the range [0, 1].
+ */
+double random_double(unsigned int seed)
+{
+    // Hash the seed
+    uint32_t hash = PCG_Hash((uint32_t)seed);
+
+    // Normalize to [0, 1]
+    return (double)hash / (double)UINT32_MAX;
+}
+
+/**
+ * @brief Generates a random double within a specified range [min, max].
+ *
+ * @param seed Seed for random number generation.
+ * @param min Minimum value of the range.
+ * @param max Maximum value of the range.
+ * @return double Random double in the range [min, max].
+ */
+double random_double_min_max(unsigned int seed, double min, double max)
+{
+    // Normalize to [0.0, 1.0]
+    double normalized = random_double(seed);
+    // Scale to [min, max]
+    return min + normalized * (max - min);
+}
+
+/**
+ * @brief Generates a random 2D vector with components between 0 and the given dimensions.
+ *
+ * @param width Width of the area.
+ * @param height Height of the area.
+ * @return vec2 Randomly generated 2D vector.
+ */
+vec2 random_vec2(int width, int height)
+{
+    vec2 rdm;
+    rdm.x = random_double_min_max(rand(), 0, width);
+    rdm.y = random_double_min_max(rand(), 0, height);
+    return rdm;
+};
+
+/**
+ * @brief Generates a 2D vector with components between 0 and the given dimensions, from a seed.
+ *
+ * Unlike random_vec2(), it does not use the global generator: runs on
+ * different threads each draw their own reproducible sequence.
+ *
+ * @param seed Seed, seed and seed + 1 are hashed.
+ * @param width Width of the area.
+ * @param height Height of the area.
+ * @return vec2 Randomly generated 2D vector.
+ */
+vec2 random_vec2_seeded(unsigned int seed, int width, int height)
+{
+    vec2 rdm;
+    rdm.x = random_double_min_max(seed, 0, width);
+    rdm.y = random_double_min_max(seed + 1, 0, height);
+    return rdm;
+}
+
+static int fast_math = 0; // Use the polynomial exp2 kernels in the terrain generator
+
+/**
+ * @brief Enables or disables the fast exp2 kernels in the terrain generator.
+ *
+ * @param enabled 1 to use fast_exp2_array(), 0 to use libm exp2().
+ */
+void set_fast_math(int enabled)
+{
+    fast_math = enabled;
+}
+
+// vector registers of the target: 32 bytes with AVX, 16 bytes (SSE2, NEON) otherwise
+#ifdef __AVX__
+#define SIMD_BYTES 32
+#else
+#define SIMD_BYTES 16
+#endif
+#define SIMD_DOUBLES (SIMD_BYTES / 8)
+#define SIMD_FLOATS (SIMD_BYTES / 4)
+typedef double vd __attribute__((vector_size(SIMD_BYTES)));
+typedef long long vl __attribute__((vector_size(SIMD_BYTES)));
+typedef float vf __attribute__((vector_size(SIMD_BYTES)));
+typedef int vi __attribute__((vector_size(SIMD_BYTES)));
+
+/**
+ * @brief Computes 2^x on a vector of doubles.
+ *
+ * x is split into n + f with n = round(x) and f in [-0.5, 0.5]. 2^f is
+ * evaluated with the degree 12 Taylor polynomial of exp(f * ln 2) and 2^n is
+ * added directly to the exponent bits. Inputs are clamped to [-1022, 1023].
+ * The rounding uses the 1.5 * 2^52 trick, so this must not be compiled with
+ * -ffast-math (which would fold (x + C) - C into x).
+ *
+ * @param x Exponents.
+ * @return vd 2^x, max relative error 4.8e-16 (about 2 ulp).
+ */
+static inline vd fast_exp2_vd(vd x)
+{
+    const vd zero = {0.0};
+    const vd lo = zero - 1022.0;
+    const vd hi = zero + 1023.0;
+    const vd magic = zero + 0x1.8p52;
+
+    // clamp with masks, the ternary operator is not available on C vectors
+    vl below = x < lo;
+    x = (vd)(((vl)x & ~below) | ((vl)lo & below));
+    vl above = x > hi;
+    x = (vd)(((vl)x & ~above) | ((vl)hi & above));
+
+    // n = round(x) in the low bits of t, f = x - n
+    vd t = x + magic;
+    vd f = x - (t - magic);
+    vl n = (vl)t - (vl)magic;
+
+    // Horner scheme on the coefficients ln2^k / k!
+    vd p = f * 2.5678435993488196e-11 + 4.4455382718708101e-10;
+    p = p * f + 7.0549116208011209e-09;
+    p = p * f + 1.0178086009239696e-07;
+    p = p * f + 1.3215486790144305e-06;
+    p = p * f + 1.5252733804059838e-05;
+    p = p * f + 0.00015403530393381606;
+    p = p * f + 0.0013333558146428441;
+    p = p * f + 0.0096181291076284769;
+    p = p * f + 0.055504108664821576;
+    p = p * f + 0.24022650695910069;
+    p = p * f + 0.69314718055994529;
+    p = p * f + 1.0;
+
+    // scale by 2^n through the exponent field
+    return (vd)((vl)p + (n << 52));
+}
+
+
+/**
+ * @brief Computes 2^x on a vector of floats.
+ *
+ * Same scheme as fast_exp2_vd() with a degree 7 polynomial. Inputs are
+ * clamped to [-126, 127].
+ *
+ * @param x Exponents.
+ * @return vf 2^x, max relative error 9.4e-8 (about 1.5 ulp).
+ */
+static inline vf fast_exp2_vf(vf x)
+{
+    const vf zero = {0.0f};
+    const vf lo = zero - 126.0f;
+    const vf hi = zero + 127.0f;
+    const vf magic = zero + 0x1.8p23f;
+
+    vi below = x < lo;
+    x = (vf)(((vi)x & ~below) | ((vi)lo & below));
+    vi above = x > hi;
+    x = (vf)(((vi)x & ~above) | ((vi)hi & above));
+
+    vf t = x + magic;
+    vf f = x - (t - magic);
+    vi n = (vi)t - (vi)magic;
+
+    // Horner scheme on the coefficients ln2^k / k!
+    vf p = f * 1.525273380e-05f + 1.540353039e-04f;
+    p = p * f + 1.333355815e-03f;
+    p = p * f + 9.618129108e-03f;
+    p = p * f + 5.550410866e-02f;
+    p = p * f + 2.402265070e-01f;
+    p = p * f + 6.931471806e-01f;
+    p = p * f + 1.000000000e+00f;
+
+    return (vf)((vi)p + (n << 23));
+}
+
+/**
+ * @brief Computes 2^x for an array of doubles with the vector kernel.
+ *
+ * @param dst Array receiving the results.
+ * @param src Exponents, may be the same array as dst.
+ * @param n Number of values.
+ */
+void fast_exp2_array(double *dst, const double *src, int n)
+{
+    int i = 0;
+    for (; i + SIMD_DOUBLES <= n; i += SIMD_DOUBLES)
+    {
+        vd x;
+        memcpy(&x, src + i, sizeof(x));
+        x = fast_exp2_vd(x);
+        memcpy(dst + i, &x, sizeof(x));
+    }
+    if (i < n)
+    {
+        vd x = {0.0};
+        memcpy(&x, src + i, (n - i) * sizeof(double));
+        x = fast_exp2_vd(x);
+        memcpy(dst + i, &x, (n - i) * sizeof(double));
+    }
+}
+
+/**
+ * @brief Computes 2^x for an array of floats with the vector kernel.
+ *
+ * @param dst Array receiving the results.
+ * @param src Exponents, may be the same array as dst.
+ * @param n Number of values.
+ */
+void fast_exp2f_array(float *dst, const float *src, int n)
+{
+    int i = 0;
+    for (; i + SIMD_FLOATS <= n; i += SIMD_FLOATS)
+    {
+        vf x;
+        memcpy(&x, src + i, sizeof(x));
+        x = fast_exp2_vf(x);
+        memcpy(dst + i, &x, sizeof(x));
+    }
+    if (i < n)
+    {
+        vf x = {0.0f};
+        memcpy(&x, src + i, (n - i) * sizeof(float));
+        x = fast_exp2_vf(x);
+        memcpy(dst + i, &x, (n - i) * sizeof(float));
+    }
+}
+
+/**
+ * @brief Selects lanes of a when the mask is set, of b otherwise.
+ */
+static inline vd select_vd(vl mask, vd a, vd b)
+{
+    return (vd)(((vl)a & mask) | ((vl)b & ~mask));
+}
+
+struct metrics_partial {
+    double sum;                    /**< Sum of the heights. */
+    double min;                    /**< Lowest height. */
+    double max;                    /**< Highest height. */
+    double eroded;                 /**< Sum of the height losses. */
+    double deposited;              /**< Sum of the height gains. */
+    double slope;                  /**< Sum of the gradient norms of the interior cells. */
+    double laplacian;              /**< Sum of the squared Laplacians of the interior cells. */
+    long valleys;                  /**< Interior cells on a valley floor. */
+    long histogram[METRICS_BINS];  /**< Cells in each bin. */
+};
+
+struct metrics_context {
+    int width;                      /**< Width of the heightmap. */
+    int height;                     /**< Height of the heightmap. */
+    const double *heightmap;        /**< Row-major heightmap. */
+    const double *reference;        /**< Reference terrain, NULL for none. */
+    double range_min;               /**< Start of the histogram. */
+    double bin_scale;               /**< Bins per height unit. */
+    struct metrics_partial *rows;   /**< Partial sums of each row. */
+};
+
+/**
+ * @brief Computes the partial sums of rows [begin, end), each in its own
+ * accumulator so the totals do not depend on the bands.
+ */
+static void metrics_rows(void *arg, int begin, int end)
+{
+    struct metrics_context *ctx = (struct metrics_context *)arg;
+    int w = ctx->width;
+    for (int y = begin; y < end; ++y)
+    {
+        struct metrics_partial *p = &ctx->rows[y];
+        const double *row = ctx->heightmap + (size_t)y * w;
+        const double *ref = ctx->reference != NULL ? ctx->reference + (size_t)y * w : NULL;
+        memset(p, 0, sizeof(*p));
+
+        // every cell: heights, volumes against the reference
+        vd sum = {0.0}, eroded = {0.0}, deposited = {0.0};
+        vd lo, hi;
+        int x = 0;
+        for (int k = 0; k < SIMD_DOUBLES; ++k)
+            lo[k] = hi[k] = row[0];
+        for (; x + SIMD_DOUBLES <= w; x += SIMD_DOUBLES)
+        {
+            vd c;
+            memcpy(&c, row + x, sizeof(c));
+            sum += c;
+            lo = select_vd(c < lo, c, lo);
+            hi = select_vd(c > hi, c, hi);
+            if (ref != NULL)
+            {
+                vd r;
+                memcpy(&r, ref + x, sizeof(r));
+                vd diff = r - c;
+                vl loss = diff > 0.0;
+                eroded += (vd)((vl)diff & loss);
+                deposited -= (vd)((vl)diff & ~loss);
+            }
+        }
+        p->min = lo[0];
+        p->max = hi[0];
+        for (int k = 0; k < SIMD_DOUBLES; ++k)
+        {
+            p->sum += sum[k];
+            p->eroded += eroded[k];
+            p->deposited += deposited[k];
+            p->min = MIN(p->min, lo[k]);
+            p->max = MAX(p->max, hi[k]);
+        }
+        for (; x < w; ++x)
+        {
+            p->sum += row[x];
+            p->min = MIN(p->min, row[x]);
+            p->max = MAX(p->max, row[x]);
+            if (ref != NULL && ref[x] > row[x])
+                p->eroded += ref[x] - row[x];
+            else if (ref != NULL)
+                p->deposited += row[x] - ref[x];
+        }
+        for (x = 0; x < w; ++x)
+        {
+            double bin = (row[x] - ctx->range_min) * ctx->bin_scale;
+            p->histogram[bin <= 0.0 ? 0 : bin >= METRICS_BINS - 1 ? METRICS_BINS - 1 : (int)bin]++;
+        }
+
+        // interior cells: central gradient, 5-point Laplacian, valley floors
+        if (y == 0 || y == ctx->height - 1 || w < 3)
+            continue;
+        const double *up = row - w;
+        const double *down = row + w;
+        vd slope = {0.0}, laplacian = {0.0};
+        vl valleys = {0};
+        for (x = 1; x + SIMD_DOUBLES <= w - 1; x += SIMD_DOUBLES)
+        {
+            vd c, l, r, u, d;
+            memcpy(&c, row + x, sizeof(c));
+            memcpy(&l, row + x - 1, sizeof(l));
+            memcpy(&r, row + x + 1, sizeof(r));
+            memcpy(&u, up + x, sizeof(u));
+            memcpy(&d, down + x, sizeof(d));
+            vd gx = (r - l) * 0.5;
+            vd gy = (d - u) * 0.5;
+            vd norm2 = gx * gx + gy * gy;
+            for (int k = 0; k < SIMD_DOUBLES; ++k)
+                slope[k] += sqrt(norm2[k]);
+            vd lap = l + r + u + d - 4.0 * c;
+            laplacian += lap * lap;
+            valleys -= ((c < l) & (c < r)) | ((c < u) & (c < d)); // true lanes are -1
+        }
+        for (int k = 0; k < SIMD_DOUBLES; ++k)
+        {
+            p->slope += slope[k];
+            p->laplacian += laplacian[k];
+            p->valleys += valleys[k];
+        }
+        for (; x < w - 1; ++x)
+        {
+            double c = row[x], l = row[x - 1], r = row[x + 1], u = up[x], d = down[x];
+            double gx = (r - l) * 0.5, gy = (d - u) * 0.5;
+            double lap = l + r + u + d - 4.0 * c;
+            p->slope += sqrt(gx * gx + gy * gy);
+            p->laplacian += lap * lap;
+            p->valleys += (c < l && c < r) || (c < u && c < d);
+        }
+    }
+}
+
+void compute_metrics(int width, int height, const double *heightmap, const double *reference, double range_min, double range_max, struct heightmap_metrics *metrics)
+{
+    memset(metrics, 0, sizeof(*metrics));
+    struct metrics_partial *rows = (struct metrics_partial *)malloc((size_t)MAX(height, 1) * sizeof(struct metrics_partial));
+    if (rows == NULL || width < 1 || height < 1)
+    {
+        free(rows);
+        return;
+    }
+    double range = range_max - range_min;
+    struct metrics_context ctx = {width, height, heightmap, reference, range_min, range > 0.0 ? METRICS_BINS / range : 0.0, rows};
+    parallel_rows(height, metrics_rows, &ctx);
+
+    // summed in row order, the same whatever the number of threads
+    struct metrics_partial total = rows[0];
+    for (int y = 1; y < height; ++y)
+    {
+        total.sum += rows[y].sum;
+        total.min = MIN(total.min, rows[y].min);
+        total.max = MAX(total.max, rows[y].max);
+        total.eroded += rows[y].eroded;
+        total.deposited += rows[y].deposited;
+        total.slope += rows[y].slope;
+        total.laplacian += rows[y].laplacian;
+        total.valleys += rows[y].valleys;
+        for (int b = 0; b < METRICS_BINS; ++b)
+            total.histogram[b] += rows[y].histogram[b];
+    }
+    free(rows);
+
+    double cells = (double)width * height;
+    double interior = (double)MAX(width - 2, 0) * MAX(height - 2, 0);
+    metrics->mean = total.sum / cells;
+    metrics->min = total.min;
+    metrics->max = total.max;
+    metrics->eroded = total.eroded;
+    metrics->deposited = total.deposited;
+    if (interior > 0.0)
+    {
+        metrics->mean_slope = total.slope / interior;
+        metrics->roughness = sqrt(total.laplacian / interior);
+        metrics->drainage = total.valleys / interior;
+    }
+    for (int b = 0; b < METRICS_BINS; ++b)
+        metrics->histogram[b] = total.histogram[b] / cells;
+}
+
+/**
+ * @brief Writes a row of a metrics log as a CSV line.
+ */
+static void metrics_write_row(FILE *f, const struct metrics_row *row)
+{
+    const struct heightmap_metrics *m = &row->metrics;
+    fprintf(f, "%d,%d,%.9g,%.9g,%.9g,%.9g,%.9g,%.9g,%.9g,%.9g", row->run_id, row->nb_drop, m->mean, m->min, m->max,
+            m->eroded, m->deposited, m->mean_slope, m->roughness, m->drainage);
+    for (int b = 0; b < METRICS_BINS; ++b)
+        fprintf(f, ",%.9g", m->histogram[b]);
+    fputc('\n', f);
+}
+
+/**
+ * @brief Parses a CSV line of a metrics log.
+ *
+ * @param line The line.
+ * @param row Parsed row.
+ * @return int 0 if successful, -1 if the line is not a complete row.
+ */
+static int metrics_parse_row(const char *line, struct metrics_row *row)
+{
+    double *fields[8 + METRICS_BINS] = {&row->metrics.mean, &row->metrics.min, &row->metrics.max, &row->metrics.eroded,
+                                        &row->metrics.deposited, &row->metrics.mean_slope, &row->metrics.roughness, &row->metrics.drainage};
+    for (int b = 0; b < METRICS_BINS; ++b)
+        fields[8 + b] = &row->metrics.histogram[b];
+
+    char *end;
+    row->run_id = (int)strtol(line, &end, 10);
+    if (end == line || *end != ',')
+        return -1;
+    line = end + 1;
+    row->nb_drop = (int)strtol(line, &end, 10);
+    for (int k = 0; k < 8 + METRICS_BINS; ++k)
+    {
+        if (end == line || *end != ',')
+            return -1;
+        line = end + 1;
+        *fields[k] = strtod(line, &end);
+    }
+    return end != line && (*end == '\n' || *end == '\r') ? 0 : -1;
+}
+
+/**
+ * @brief Adds a row to the rows of a metrics log, lock held.
+ *
+ * @return int 0 if successful, -1 if there is an error.
+ */
+static int metrics_add_row(struct metrics_log *log, const struct metrics_row *row)
+{
+    if (log->count == log->capacity)
+    {
+        int capacity = MAX(log->capacity * 2, 256);
+        struct metrics_row *rows = (struct metrics_row *)realloc(log->rows, (size_t)capacity * sizeof(struct metrics_row));
+        if (rows == NULL)
+        {
+            printf("Memory allocation error for the metrics rows.\n");
+            return -1;
+        }
+        log->rows = rows;
+        log->capacity = capacity;
+    }
+    log->rows[log->count++] = *row;
+    return 0;
+}
+
+int metrics_open(struct metrics_log *log, const char *filename, const double *reference, int width, int height, int append)
+{
+    memset(log, 0, sizeof(*log));
+    log->reference = reference;
+    log->width = width;
+    log->height = height;
+    log->range_min = log->range_max = reference[0];
+    for (size_t i = 1; i < (size_t)width * height; ++i)
+    {
+        log->range_min = MIN(log->range_min, reference[i]);
+        log->range_max = MAX(log->range_max, reference[i]);
+    }
+
+    // appended to with O_APPEND, rows of forked runs never overwrite each other
+    if (create_parent_directories(filename) != 0 || (log->f = fopen(filename, "a+")) == NULL || (!append && ftruncate(fileno(log->f), 0) != 0))
+    {
+        printf("Error opening the metrics log %s: %s\n", filename, strerror(errno));
+        if (log->f != NULL)
+            fclose(log->f);
+        return -1;
+    }
+    pthread_mutex_init(&log->lock, NULL);
+
+    // rows of an earlier sweep, a torn last line left by a crash ignored
+    char line[2048];
+    int complete = 1, empty = 1;
+    struct metrics_row row;
+    rewind(log->f);
+    while (fgets(line, sizeof(line), log->f) != NULL)
+    {
+        empty = 0;
+        complete = strchr(line, '\n') != NULL;
+        if (metrics_parse_row(line, &row) == 0)
+            metrics_add_row(log, &row);
+    }
+    fseek(log->f, 0, SEEK_END);
+    if (empty)
+    {
+        fprintf(log->f, "run_id,nb_drop,mean,min,max,eroded,deposited,mean_slope,roughness,drainage");
+        for (int b = 0; b < METRICS_BINS; ++b)
+            fprintf(log->f, ",h%d", b);
+        fputc('\n', log->f);
+    }
+    else if (!complete)
+        fputc('\n', log->f);
+    fflush(log->f);
+    return 0;
+}
+
+void metrics_record(struct metrics_log *log, int run_id, int nb_drop, const double *heightmap)
+{
+    struct metrics_row row = {.run_id = run_id, .nb_drop = nb_drop};
+    compute_metrics(log->width, log->height, heightmap, log->reference, log->range_min, log->range_max, &row.metrics);
+
+    // a resumed run writes its rows after the checkpoint again: the last row of a drop count wins
+    pthread_mutex_lock(&log->lock);
+    metrics_add_row(log, &row);
+    metrics_write_row(log->f, &row);
+    fflush(log->f);
+    pthread_mutex_unlock(&log->lock);
+}
+
+int metrics_copy_run(struct metrics_log *log, int run_id, int source_run_id)
+{
+    int nb_copied = 0;
+    pthread_mutex_lock(&log->lock);
+    int count = log->count;
+    for (int i = 0; i < count; ++i)
+    {
+        if (log->rows[i].run_id == run_id)
+            count = 0; // already copied when a resumed sweep runs again
+    }
+    for (int i = 0; i < count; ++i)
+    {
+        struct metrics_row row = log->rows[i];
+        if (row.run_id != source_run_id)
+            continue;
+        row.run_id = run_id;
+        if (metrics_add_row(log, &row) != 0)
+            break;
+        metrics_write_row(log->f, &row);
+        ++nb_copied;
+    }
+    fflush(log->f);
+    pthread_mutex_unlock(&log->lock);
+    return nb_copied;
+}
+
+void metrics_close(struct metrics_log *log)
+{
+    fclose(log->f);
+    pthread_mutex_destroy(&log->lock);
+    free(log->rows);
+    log->rows = NULL;
+    log->count = log->capacity = 0;
+}
+
+/**
+ * @brief Computes the gradient at a given position on the heightmap.
+ *
+ * @param w Width of the heightmap.
+ * @param h Heightmap.
+ * @param pos Position (vec2) to compute the gradient at.
+ * @return vec2 Gradient vector at the given position.
+ */
+vec2 compute_gradient_central(int w, double *h, vec2 pos)
+{
+    int x = (int)pos.x;
+    int y = (int)pos.y;
+
+    if (x < 1 || x >= w - 1 || y < 1 || y >= w - 1)
+        return (vec2){0.0, 0.0};
+
+    vec2 gradient;
+    gradient.x = (H(h, w, x + 1, y) - H(h, w, x - 1, y)) * 0.5;
+    gradient.y = (H(h, w, x, y + 1) - H(h, w, x, y - 1)) * 0.5;
+
+    return gradient;
+}
+
+/**
+ * @brief Computes the gradient at a given position on the heightmap.
+ *
+ * @param w Width of the heightmap.
+ * @param h Heightmap.
+ * @param pos Position (vec2) to compute the gradient at.
+ * @return vec2 Gradient vector at the given position.
+ */
+vec2 compute_gradient(int w, double *h, vec2 pos)
+{
+    int x = (int)pos.x;
+    int y = (int)pos.y;
+    double u = 0.5;
+    double v = 0.5;
+    vec2 gradient;
+    gradient.x = (H(h, w, x + 1, y) - H(h, w, x, y)) * (1.0 - v) +
+                 (H(h, w, x + 1, y + 1) - H(h, w, x, y + 1)) * v;
+    gradient.y = (H(h, w, x, y + 1) - H(h, w, x, y)) * (1.0 - u) +
+                 (H(h, w, x + 1, y + 1) - H(h, w, x + 1, y)) * u;
+    return gradient;
+}
+
+/**
+ * @brief Verifies if a drop's position is within the valid heightmap boundaries.
+ *
+ * @param drop The drop object.
+ * @param width Width of the heightmap.
+ * @param height Height of the heightmap.
+ * @return int 1 if the position is valid, 0 otherwise.
+ */
+int verify_drop_pos(struct drop drop, int width, int height)
+{
+    int x = (int)drop.position.x;
+    int y = (int)drop.position.y;
+    return 0 < x && x < width - 1 && 0 < y && y < height - 1;
+}
+
+/**
+ * @brief Allocates the tile bitmap of a dirty tracker and resets it.
+ *
+ * The bitmap has one bit per DIRTY_TILE x DIRTY_TILE tile, set by
+ * dirty_mark() with the rectangle: consumers of the heightmap can skip the
+ * tiles no drop wrote to since the last reset instead of rescanning them.
+ *
+ * @param dirty The tracker.
+ * @param width Width of the heightmap (columns).
+ * @param height Height of the heightmap (rows).
+ * @return int 0 if successful, -1 if the bitmap could not be allocated (the rectangle is still tracked).
+ */
+int dirty_init(struct dirty_tracker *dirty, int width, int height)
+{
+    dirty->tiles_x = (width + DIRTY_TILE - 1) / DIRTY_TILE;
+    dirty->tiles_y = (height + DIRTY_TILE - 1) / DIRTY_TILE;
+    dirty->tiles = (uint64_t *)malloc(((size_t)dirty->tiles_x * dirty->tiles_y + 63) / 64 * sizeof(uint64_t));
+    if (dirty->tiles == NULL)
+        dirty->tiles_x = dirty->tiles_y = 0;
+    dirty_reset(dirty);
+    return dirty->tiles != NULL ? 0 : -1;
+}
+
+/**
+ * @brief Copies the rectangle and the tiles of a tracker into another one of the same size.
+ *
+ * @param dst The tracker receiving the copy.
+ * @param src The tracker to copy, NULL to mark every cell.
+ * @param width Width of the heightmap.
+ * @param height Height of the heightmap.
+ */
+void dirty_copy(struct dirty_tracker *dst, const struct dirty_tracker *src, int width, int height)
+{
+    dirty_reset(dst);
+    if (src == NULL || src->tiles == NULL || dst->tiles == NULL || src->tiles_x != dst->tiles_x || src->tiles_y != dst->tiles_y)
+    {
+        // without the source tiles, every tile of the rectangle is dirty
+        if (src == NULL)
+            dirty_mark(dst, 0, 0, width - 1, height - 1);
+        else if (src->x_max >= 0)
+            dirty_mark(dst, src->x_min, src->y_min, src->x_max, src->y_max);
+        return;
+    }
+    dst->x_min = src->x_min;
+    dst->y_min = src->y_min;
+    dst->x_max = src->x_max;
+    dst->y_max = src->y_max;
+    memcpy(dst->tiles, src->tiles, ((size_t)src->tiles_x * src->tiles_y + 63) / 64 * sizeof(uint64_t));
+}
+
+/**
+ * @brief Releases the tile bitmap of a dirty tracker.
+ *
+ * @param dirty The tracker.
+ */
+void dirty_free(struct dirty_tracker *dirty)
+{
+    free(dirty->tiles);
+    dirty->tiles = NULL;
+    dirty->tiles_x = dirty->tiles_y = 0;
+}
+
+/**
+ * @brief Simulates sediment deposition for a drop at a given position.
+ *
+ * @param width Width of the heightmap.
+ * @param height Height of the heightmap.
+ * @param heightmap 2D heightmap array.
+ * @param pos Position of the drop (vec2).
+ * @param to_drop Amount of sediment to deposit.
+ * @param dirty Tracker of the written cells, or NULL.
+ * @return double Amount of sediment actually deposited.
+ */
+double simulate_deposition(int width, int height, double heightmap[width][height], vec2 pos, double to_drop, struct dirty_tracker *dirty)
+{
+    int x1 = (int)pos.x;
+    int y1 = (int)pos.y;
+
+    int x2 = MIN(x1 + 1, width - 1);
+    int y2 = MIN(y1 + 1, height - 1);
+
+    double dx = pos.x - x1;
+    double dy = pos.y - y1;
+
+    double w11 = (1.0 - dx) * (1.0 - dy); // Weight for (x1, y1)
+    double w12 = (1.0 - dx) * dy;         // Weight for (x1, y2)
+    double w21 = dx * (1.0 - dy);         // Weight for (x2, y1)
+    double w22 = dx * dy;                 // Weight for (x2, y2)
+
+    double sum_w = w11 + w12 + w21 + w22;
+    if (sum_w <= EPSILON)
+        return 0.0;
+
+    w11 /= sum_w;
+    w12 /= sum_w;
+    w21 /= sum_w;
+    w22 /= sum_w;
+
+    double sum_dropped = 0.0;
+    double dropped;
+    if (to_drop > 0.0)
+        dirty_mark(dirty, x1, y1, x2, y2);
+    if (to_drop * w11 > 0.0)
+    {
+        dropped = to_drop * w11;
+        H(*heightmap, width, x1, y1) += dropped;
+        sum_dropped += dropped;
+    }
+    if (to_drop * w12 > 0.0)
+    {
+        dropped = to_drop * w12;
+        H(*heightmap, width, x1, y2) += dropped;
+        sum_dropped += dropped;
+    }
+    if (to_drop * w21 > 0.0)
+    {
+        dropped = to_drop * w21;
+        H(*heightmap, width, x2, y1) += dropped;
+        sum_dropped += dropped;
+    }
+    if (to_drop * w22 > 0.0)
+    {
+        dropped = to_drop * w22;
+        H(*heightmap, width, x2, y2) += dropped;
+        sum_dropped += dropped;
+    }
+
+    return sum_dropped;
+}
+
+/**
+ * @brief Simulates a single erosion event by dropping particles on the terrain.
+ *
+ * @param width Width of the heightmap.
+ * @param height Height of the heightmap.
+ * @param heightmap 2D heightmap array.
+ * @param drop The drop object (particle).
+ * @param capacity Maximum sediment capacity of the terrain.
+ * @param inertia Inertia factor of sediment.
+ * @param slope Slope factor affecting sediment deposition.
+ * @param gravity Gravity force.
+ * @param evaporation Evaporation rate of sediment.
+ * @param dirty Tracker of the written cells, or NULL.
+ * @return double Amount of sediment deposited.
+ */
+void simulate_drop(int height, int width, double heightmap[width][height], struct drop drop, struct parameters param, struct dirty_tracker *dirty)
+{
+    while (drop.lifetime > 0 && verify_drop_pos(drop, width, height) && drop.water > EPSILON)
+    {
+        // 0 - update lifetime
+        drop.lifetime--;
+
+        // 1 - get gradient
+        vec2 gradient = compute_gradient(width, *heightmap, drop.position);
+
+        // 2 - new direction
+        vec2 new_dir;
+        new_dir.x = drop.direction.x * param.inertia - gradient.x * (1.0 - param.inertia);
+        new_dir.y = drop.direction.y * param.inertia - gradient.y * (1.0 - param.inertia);
+
+        double norm = sqrt(new_dir.x * new_dir.x + new_dir.y * new_dir.y);
+        while (norm <= EPSILON) // hopefully we don't stay here too long
+        {
+            new_dir.x = random_double(drop.seed++);
+            new_dir.y = random_double(drop.seed++);
+            norm = sqrt(new_dir.x * new_dir.x + new_dir.y * new_dir.y);
+        }
+        new_dir.x /= norm;
+        new_dir.y /= norm;
+
+        // 3 - new position
+        vec2 old_pos = drop.position;
+        drop.position.x = drop.position.x + new_dir.x;
+        drop.position.y = drop.position.y + new_dir.y;
+
+        // gone: went out of bound
+        if (!verify_drop_pos(drop, width, height))
+            break;
+
+        // 4 - height difference h_diff
+        double h_diff = H(*heightmap, width, (int)drop.position.x, (int)drop.position.y) -
+                        H(*heightmap, width, (int)old_pos.x, (int)old_pos.y);
+
+        if (h_diff > 0.0)
+        {
+            double to_drop;
+            double keep_going = drop.sediment >= h_diff;
+            if (keep_going)
+            {
+                to_drop = h_diff;
+                to_drop -= simulate_deposition(width, height, heightmap, old_pos, to_drop, dirty);
+                while (to_drop > EPSILON)
+                    to_drop -= simulate_deposition(width, height, heightmap, old_pos, drop.sediment, dirty);
+                break;
+            }
+            else
+            {
+                to_drop = drop.sediment;
+                drop.sediment -= simulate_deposition(width, height, heightmap, old_pos, to_drop, dirty);
+                while (drop.sediment > EPSILON)
+                    drop.sediment -= simulate_deposition(width, height, heightmap, old_pos, drop.sediment, dirty);
+                break;
+            }
+        }
+        else
+        {
+            // 5 - new capacity c
+            double c = MAX(-h_diff, param.slope) * drop.velocity * drop.water * param.capacity;
+            if (drop.sediment >= c) // deposit
+            {
+                double to_drop = (drop.sediment - c) * param.deposition;
+                double dropped = simulate_deposition(width, height, heightmap, old_pos, to_drop, dirty);
+                drop.sediment -= dropped;
+            }
+            else // erode
+            {
+                double gain = MIN((c - drop.sediment) * param.erosion, -h_diff);
+                double total_weight = 0.0;
+                int size_weights = (2 * param.radius + 1) * (2 * param.radius + 1);
+                struct weight weights[size_weights];
+                int index = 0;
+                // Iterate over the radius square
+                for (int dx = -param.radius; dx <= param.radius; ++dx)
+                {
+                    for (int dy = -param.radius; dy <= param.radius; ++dy)
+                    {
+
+                        int x = (int)(old_pos.x + dx);
+                        int y = (int)(old_pos.y + dy);
+
+                        weights[index].used = 0;
+                        if (0 <= x && x < width && 0 <= y && y < height)
+                        {
+                            double dist = sqrt(dx * dx + dy * dy);
+                            if (dist <= (double)param.radius)
+                            {
+                                weights[index].w = (double)param.radius - dist;
+                                weights[index].x = x;
+                                weights[index].y = y;
+                                total_weight += weights[index].w;
+                                weights[index].used = 1;
+                            }
+                        }
+
+                        ++index;
+                    }
+                }
+
+                // Normalize weights and apply erosion
+                if (total_weight > 0.0)
+                {
+                    dirty_mark(dirty, MAX((int)(old_pos.x - param.radius), 0), MAX((int)(old_pos.y - param.radius), 0),
+                               MIN((int)(old_pos.x + param.radius), width - 1), MIN((int)(old_pos.y + param.radius), height - 1));
+                    for (int i = 0; i < size_weights; ++i)
+                    {
+                        if (weights[i].used)
+                        {
+                            float taux_evap = 0.0;
+                            if (drop.position.x > width / 2)
+                            {
+                                taux_evap = 0.8;
+                            }
+                            else
+                            {
+                                taux_evap = 0.1;
+                            }
+                            double quantity = gain * (weights[i].w / total_weight) * 1;
+                            H(*heightmap, width, weights[i].x, weights[i].y) -= quantity;
+                            drop.sediment += quantity;
+                        }
+                    }
+                }
+            }
+        }
+
+        // 6 - new velocity
+        drop.velocity = sqrt(drop.velocity * drop.velocity + ABS(h_diff) * param.gravity);
+
+        // 7 - new water
+        drop.water *= (1.0 - param.evaporation);
+    }
+}
+
+struct convergence_monitor {
+    double *previous; /**< Heightmap at the previous snapshot, NULL when the monitor is off. */
+    int last_drop;    /**< Drop count of the previous snapshot. */
+    int windows;      /**< Consecutive windows whose change stayed below the thresholds. */
+};
+
+/**
+ * @brief Starts monitoring the convergence of a run, if its options ask for it.
+ *
+ * @param monitor The monitor.
+ * @param width Width of the heightmap.
+ * @param height Height of the heightmap.
+ * @param heightmap Starting state of the run.
+ * @param nb_drop Drop count of the starting state.
+ * @param options Output options of the run.
+ */
+static void convergence_init(struct convergence_monitor *monitor, int width, int height, const double *heightmap, int nb_drop, const struct run_options *options)
+{
+    monitor->previous = NULL;
+    monitor->last_drop = nb_drop;
+    monitor->windows = 0;
+    if (options->converge_windows < 1 || options->converge_l1 <= 0.0)
+        return;
+    monitor->previous = (double *)malloc((size_t)width * height * sizeof(double));
+    if (monitor->previous == NULL)
+        printf("Memory allocation error for the convergence monitor, the run will not stop early.\n");
+    else
+        memcpy(monitor->previous, heightmap, (size_t)width * height * sizeof(double));
+}
+
+/**
+ * @brief Measures the change of the heightmap since the previous snapshot.
+ *
+ * Only the tiles written since then are compared and copied: the others have
+ * not changed. A window is converged when the L1 change per drop is below
+ * converge_l1 and, if set, the largest change of a cell below converge_linf.
+ *
+ * @param monitor The monitor.
+ * @param width Width of the heightmap.
+ * @param heightmap Current state of the run.
+ * @param dirty Cells written since the previous snapshot.
+ * @param nb_drop Drop count of the current state.
+ * @param options Output options of the run.
+ * @return int 1 when converge_windows windows in a row are converged, 0 otherwise.
+ */
+static int convergence_update(struct convergence_monitor *monitor, int width, const double *heightmap, const struct dirty_tracker *dirty, int nb_drop, const struct run_options *options)
+{
+    if (monitor->previous == NULL || nb_drop <= monitor->last_drop)
+        return 0;
+    double l1 = 0.0, linf = 0.0;
+    for (int ty = dirty->y_min / DIRTY_TILE; ty <= dirty->y_max / DIRTY_TILE && dirty->y_max >= 0; ++ty)
+    {
+        for (int tx = dirty->x_min / DIRTY_TILE; tx <= dirty->x_max / DIRTY_TILE; ++tx)
+        {
+            if (!dirty_tile(dirty, tx, ty))
+                continue;
+            int x0 = MAX(tx * DIRTY_TILE, dirty->x_min), x1 = MIN((tx + 1) * DIRTY_TILE - 1, dirty->x_max);
+            int y0 = MAX(ty * DIRTY_TILE, dirty->y_min), y1 = MIN((ty + 1) * DIRTY_TILE - 1, dirty->y_max);
+            for (int y = y0; y <= y1; ++y)
+            {
+                const double *row = heightmap + (size_t)y * width;
+                double *previous = monitor->previous + (size_t)y * width;
+                for (int x = x0; x <= x1; ++x)
+                {
+                    double change = fabs(row[x] - previous[x]);
+                    l1 += change;
+                    linf = MAX(linf, change);
+                    previous[x] = row[x];
+                }
+            }
+        }
+    }
+
+    int converged = l1 / (nb_drop - monitor->last_drop) < options->converge_l1 && (options->converge_linf <= 0.0 || linf < options->converge_linf);
+    monitor->windows = converged ? monitor->windows + 1 : 0;
+    monitor->last_drop = nb_drop;
+    return monitor->windows >= options->converge_windows;
+}
+
+/**
+ * @brief Simulates erosion on the terrain with detailed particle drop events.
+ *
+ * Every nb_particule_before_save drops, a copy of the heightmap is handed to a
+ * snapshot writer thread, so encoding and writing overlap with the simulation.
+ * When options->archive is set, snapshots are appended to it as frames of
+ * options->run_id and path_name is not used. When options->animated is set,
+ * PNG snapshots are the frames of path_name.png, each covering the cells
+ * simulate_drop() wrote since the previous one. Drop i spawns from
+ * PCG_Hash(PCG_Hash(options->seed) + i), so runs on several threads are
+ * independent and reproducible, and two seeds share no run of drops. With
+ * options->converge_windows, the run ends at the snapshot where the terrain
+ * stopped changing for that many windows; its remaining final drop counts
+ * get its state at that point.
+ *
+ * @param width Width of the heightmap.
+ * @param height Height of the heightmap.
+ * @param num_particles Number of particles to simulate.
+ * @param heightmap 2D heightmap array.
+ * @param capacity Maximum sediment capacity of the terrain.
+ * @param inertia Inertia factor of sediment.
+ * @param slope Slope factor affecting sediment deposition.
+ * @param gravity Gravity force.
+ * @param evaporation Evaporation rate of sediment.
+ * @param options Output options of the snapshots, NULL for RUN_OPTIONS_DEFAULT.
+ */
+void simulate_erosion_detailed(int height, int width, double heightmap[width][height], struct parameters param, int nb_drop, char *path_name, int nb_particule_before_save, const struct run_options *options)
+{
+    struct run_options default_options = RUN_OPTIONS_DEFAULT;
+    if (options == NULL)
+        options = &default_options;
+
+    unsigned int seed = options->seed;
+    if (seed == 0)
+    {
+        random_init();
+        seed = (unsigned int)rand();
+    }
+    // the seed is mixed before the drop index: nearby seeds give unrelated streams
+    uint32_t stream = PCG_Hash((uint32_t)seed);
+    struct drop drop;
+    char name[1024];
+    struct snapshot_writer writer;
+    struct dirty_tracker dirty;
+    struct convergence_monitor monitor;
+    dirty_init(&dirty, width, height);
+    int async = snapshot_writer_start(&writer, width, height, options) == 0;
+    int animated = async && options->animated && options->archive == NULL && strcmp(format_extension(options->format), ".png") == 0;
+    int first = MAX(options->first_drop, 1);
+    convergence_init(&monitor, width, height, *heightmap, first, options);
+    int next_final = 0;
+    while (next_final < options->nb_final_drops && options->final_drops[next_final] < first)
+        ++next_final;
+    for (int i = first; i <= nb_drop; ++i)
+    {
+        if (i % nb_particule_before_save == 0)
+        {
+            int converged = convergence_update(&monitor, width, *heightmap, &dirty, i, options);
+            if (animated)
+                snprintf(name, sizeof(name), "%s.png", path_name);
+            else
+                snprintf(name, sizeof(name), "%s%d%s", path_name, i, format_extension(options->format));
+            // printf("%s\n", name);
+            if (async)
+            {
+                snapshot_writer_submit(&writer, *heightmap, name, i, &dirty);
+                dirty_reset(&dirty);
+            }
+            else
+            {
+                if (options->metrics != NULL)
+                    metrics_record(options->metrics, options->run_id, i, *heightmap);
+                if (!options->metrics_only)
+                {
+                    if (options->archive != NULL)
+                        archive_append(options->archive, options->run_id, i, *heightmap);
+                    else
+                        save_heightmap_as_image(width, height, heightmap, name, options);
+                }
+            }
+            if (converged)
+            {
+                // the terrain stopped changing: it stands for the later final states
+                struct run_options raw = {.format = RAW_F64, .profile = PNG_ARCHIVAL};
+                for (int f = next_final; f < options->nb_final_drops; ++f)
+                {
+                    snprintf(name, sizeof(name), "%s_final_%d.hmap", path_name, options->final_drops[f]);
+                    save_heightmap_as_image(width, height, heightmap, name, &raw);
+                }
+                printf("Run %d converged at drop %d of %d\n", options->run_id, i, nb_drop);
+                break;
+            }
+        }
+        // each drop hashes its own seed: the run does not share the global generator
+        uint32_t hash = PCG_Hash(stream + (uint32_t)i);
+        drop.position = random_vec2_seeded(hash, width, height);
+        drop.seed = hash + 2;
+        drop.direction.x = 0.0;
+        drop.direction.y = 0.0;
+        drop.velocity = 1.0;
+        drop.water = 1.0;
+        drop.sediment = 0.0;
+        drop.lifetime = 1000;
+        simulate_drop(height, width, heightmap, drop, param, &dirty); // Directly modify heightmap here
+
+        // longer runs contain the shorter ones: same drops, same order
+        if (next_final < options->nb_final_drops && i == options->final_drops[next_final])
+        {
+            struct run_options raw = {.format = RAW_F64, .profile = PNG_ARCHIVAL};
+            snprintf(name, sizeof(name), "%s_final_%d.hmap", path_name, i);
+            save_heightmap_as_image(width, height, heightmap, name, &raw);
+            ++next_final;
+        }
+    }
+    if (async)
+        snapshot_writer_stop(&writer);
+    dirty_free(&dirty);
+    free(monitor.previous);
+}
+
+/**
+ * Simulates erosion on a given heightmap using specified parameters and a given number of erosion drops.
+ *
+ * @param height Height of the terrain grid.
+ * @param width Width of the terrain grid.
+ * @param heightmap 2D array representing the height values.
+ * @param param Structure containing erosion parameters.
+ * @param nb_drop Number of erosion drops to apply.
+ */
+void simulate_erosion(int height, int width, double heightmap[width][height], struct parameters param, int nb_drop)
+{
+    char *e = "";
+    simulate_erosion_detailed(height, width, heightmap, param, nb_drop, e, nb_drop, NULL);
+}
+
+/**
+ * Generates a heightmap with Gaussian boss peaks. The same seed always gives
+ * the same terrain.
+ *
+ * @param width Width of the heightmap.
+ * @param height Height of the heightmap.
+ * @param heightmap 2D array representing the terrain heightmap.
+ * @param num_bosses Number of Gaussian boss peaks to generate.
+ * @param scale Scale factor to apply to the generated height values.
+ * @param width_range Min and max width of the boss peaks.
+ * @param amplitude_range Min and max amplitude of the boss peaks.
+ * @param seed Seed of the boss draws.
+ */
+void generate_random_heightgaussian(int width, int height, double heightmap[width][height], int num_bosses, int scale, vec2 width_range, vec2 amplitude_range, unsigned int seed)
+{
+    // draw the bosses and bin them by position
+    struct boss *bosses = (struct boss *)malloc(num_bosses * sizeof(struct boss));
+    double *tile = (double *)malloc(GENERATOR_TILE * GENERATOR_TILE * sizeof(double));
+    struct boss_grid grid;
+    if (bosses == NULL || tile == NULL)
+    {
+        printf("Memory allocation error for the bosses.\n");
+        free(bosses);
+        free(tile);
+        return;
+    }
+    generate_bosses(bosses, num_bosses, seed, width, height, width_range, amplitude_range);
+    if (boss_grid_build(&grid, bosses, num_bosses, width, height) != 0)
+    {
+        printf("Memory allocation error for the boss grid.\n");
+        free(bosses);
+        free(tile);
+        return;
+    }
+
+    // accumulate all the bosses overlapping a tile while it is hot in cache
+    for (int x0 = 0; x0 < height; x0 += GENERATOR_TILE)
+    {
+        for (int y0 = 0; y0 < width; y0 += GENERATOR_TILE)
+        {
+            int rows = MIN(GENERATOR_TILE, height - x0);
+            int cols = MIN(GENERATOR_TILE, width - y0);
+            generate_heightgaussian_tile(x0, y0, rows, cols, tile, bosses, &grid, scale);
+            for (int x = 0; x < rows; ++x)
+                memcpy(&heightmap[x0 + x][y0], tile + x * cols, cols * sizeof(double));
+        }
+    }
+    boss_grid_free(&grid);
+    free(bosses);
+    free(tile);
+
+    // find min & max (the tiles are already scaled)
+    double min = heightmap[0][0]; // min float;
+    double max = heightmap[0][0]; // max float;
+    for (int x = 0; x < height; ++x)
+    {
+        for (int y = 0; y < width; ++y)
+        {
+            if (heightmap[x][y] > max)
+                max = heightmap[x][y];
+            if (heightmap[x][y] < min)
+                min = heightmap[x][y];
+        }
+    }
+
+    // normalize to 0 - 255
+    for (int x = 0; x < height; ++x)
+    {
+        for (int y = 0; y < width; ++y)
+        {
+            heightmap[x][y] -= min;
+            heightmap[x][y] /= (max - min);
+            heightmap[x][y] *= 255.0;
+        }
+    }
+}
+
+/**
+ * Draws the center, width and amplitude of one Gaussian boss peak.
+ *
+ * Every parameter derives from PCG_Hash(PCG_Hash(seed) + index) only, so
+ * bosses can be drawn in any order, in parallel or lazily and always come out
+ * the same.
+ *
+ * @param seed Seed of the terrain.
+ * @param index Index of the boss.
+ * @param width Width of the heightmap.
+ * @param height Height of the heightmap.
+ * @param width_range Min and max width of the boss peaks.
+ * @param amplitude_range Min and max amplitude of the boss peaks.
+ * @return struct boss The boss peak.
+ */
+struct boss generate_boss(unsigned int seed, int index, int width, int height, vec2 width_range, vec2 amplitude_range)
+{
+    uint32_t hash = PCG_Hash(PCG_Hash(seed) + (uint32_t)index); // seed mixed first: nearby seeds share no boss
+    struct boss boss;
+
+    // position random
+    boss.center.x = random_double_min_max(hash, 0, width);
+    boss.center.y = random_double_min_max(hash + 1, 0, height);
+
+    // random width_range
+    // width_range.x is min width and width_range.y is max
+    boss.width = random_double_min_max(hash + 2, width_range.x, width_range.y);
+
+    // random amplitud
+    boss.amplitude = random_double_min_max(hash + 3, amplitude_range.x, amplitude_range.y);
+    return boss;
+}
+
+/**
+ * Draws the center, width and amplitude of Gaussian boss peaks.
+ *
+ * @param bosses Array receiving the bosses.
+ * @param num_bosses Number of bosses to draw.
+ * @param seed Seed of the terrain.
+ * @param width Width of the heightmap.
+ * @param height Height of the heightmap.
+ * @param width_range Min and max width of the boss peaks.
+ * @param amplitude_range Min and max amplitude of the boss peaks.
+ */
+void generate_bosses(struct boss *bosses, int num_bosses, unsigned int seed, int width, int height, vec2 width_range, vec2 amplitude_range)
+{
+    for (int i = 0; i < num_bosses; ++i)
+        bosses[i] = generate_boss(seed, i, width, height, width_range, amplitude_range);
+}
+
+/**
+ * Bins boss centers into a uniform grid whose cells are as large as the
+ * largest boss cutoff radius.
+ *
+ * A boss can then only reach the cells adjacent to its own, so a tile only has
+ * to look at the grid cells it overlaps, grown by one cell on each side.
+ *
+ * @param grid Grid to build, freed with boss_grid_free().
+ * @param bosses Boss peaks of the terrain.
+ * @param num_bosses Number of boss peaks.
+ * @param width Width of the heightmap.
+ * @param height Height of the heightmap.
+ * @return int 0 if successful, -1 if there is an error.
+ */
+int boss_grid_build(struct boss_grid *grid, const struct boss *bosses, int num_bosses, int width, int height)
+{
+    double max_width = 0.0;
+    for (int i = 0; i < num_bosses; ++i)
+        max_width = MAX(bosses[i].width, max_width);
+
+    grid->cell_size = MAX(BOSS_CUTOFF * max_width, 1.0);
+    grid->rows = (int)(height / grid->cell_size) + 1;
+    grid->cols = (int)(width / grid->cell_size) + 1;
+    grid->cell_start = (int *)calloc(grid->rows * grid->cols + 1, sizeof(int));
+    grid->indices = (int *)malloc(MAX(num_bosses, 1) * sizeof(int));
+    int *fill = (int *)calloc(grid->rows * grid->cols, sizeof(int));
+    if (grid->cell_start == NULL || grid->indices == NULL || fill == NULL)
+    {
+        free(fill);
+        boss_grid_free(grid);
+        return -1;
+    }
+
+    // counting sort of the bosses by cell, keeping the boss order inside a cell
+    for (int i = 0; i < num_bosses; ++i)
+        ++grid->cell_start[boss_grid_cell(grid, bosses[i].center) + 1];
+    for (int c = 0; c < grid->rows * grid->cols; ++c)
+        grid->cell_start[c + 1] += grid->cell_start[c];
+    for (int i = 0; i < num_bosses; ++i)
+    {
+        int c = boss_grid_cell(grid, bosses[i].center);
+        grid->indices[grid->cell_start[c] + fill[c]++] = i;
+    }
+
+    free(fill);
+    return 0;
+}
+
+/**
+ * Frees the arrays of a boss grid.
+ *
+ * @param grid Grid built by boss_grid_build().
+ */
+void boss_grid_free(struct boss_grid *grid)
+{
+    free(grid->cell_start);
+    free(grid->indices);
+    grid->cell_start = NULL;
+    grid->indices = NULL;
+}
+
+/**
+ * Computes one tile of a Gaussian boss heightmap, scaled but not normalized.
+ *
+ * Each boss only touches the cells of its bounding square of side
+ * 2 * BOSS_CUTOFF * width, so a cell value depends on its absolute coordinates
+ * and on the boss list only: tiles join without seams whatever their size.
+ * Only the bosses binned in the grid cells around the tile are visited, in a
+ * fixed cell-then-index order, so the summation order does not depend on the
+ * tile either. When set_fast_math() is enabled, exp2 goes through
+ * fast_exp2_array() instead of libm.
+ *
+ * @param x0 First row of the tile.
+ * @param y0 First column of the tile.
+ * @param tile_rows Number of rows in the tile.
+ * @param tile_cols Number of columns in the tile.
+ * @param tile Row-major array of tile_rows * tile_cols values receiving the tile.
+ * @param bosses Boss peaks of the terrain.
+ * @param grid Bosses binned with boss_grid_build().
+ * @param scale Scale factor for the height values.
+ */
+void generate_heightgaussian_tile(int x0, int y0, int tile_rows, int tile_cols, double *tile, const struct boss *bosses, const struct boss_grid *grid, int scale)
+{
+    for (int i = 0; i < tile_rows * tile_cols; ++i)
+        tile[i] = 0.0;
+
+    // grid cells whose bosses may reach the tile
+    int gx_min = MAX((int)(x0 / grid->cell_size) - 1, 0);
+    int gx_max = MIN((int)((x0 + tile_rows - 1) / grid->cell_size) + 1, grid->rows - 1);
+    int gy_min = MAX((int)(y0 / grid->cell_size) - 1, 0);
+    int gy_max = MIN((int)((y0 + tile_cols - 1) / grid->cell_size) + 1, grid->cols - 1);
+
+    for (int gx = gx_min; gx <= gx_max; ++gx)
+    {
+        for (int gy = gy_min; gy <= gy_max; ++gy)
+        {
+            int c = gx * grid->cols + gy;
+            for (int k = grid->cell_start[c]; k < grid->cell_start[c + 1]; ++k)
+            {
+                const struct boss *b = &bosses[grid->indices[k]];
+                double cutoff = BOSS_CUTOFF * b->width;
+
+                // clip the bounding square of the boss to the tile
+                int x_min = MAX((int)ceil(b->center.x - cutoff), x0);
+                int x_max = MIN((int)floor(b->center.x + cutoff), x0 + tile_rows - 1);
+                int y_min = MAX((int)ceil(b->center.y - cutoff), y0);
+                int y_max = MIN((int)floor(b->center.y + cutoff), y0 + tile_cols - 1);
+                if (x_min > x_max || y_min > y_max)
+                    continue;
+
+                double inv_two_w2 = 1.0 / (2 * b->width * b->width);
+                int n = y_max - y_min + 1;
+                double values[n];
+                for (int x = x_min; x <= x_max; ++x)
+                {
+                    double *row = tile + (x - x0) * tile_cols - y0;
+                    double dx2 = (x - b->center.x) * (x - b->center.x);
+                    if (fast_math)
+                    {
+                        // whole row segment through the vector kernel
+                        for (int y = y_min; y <= y_max; ++y)
+                            values[y - y_min] = -(dx2 + (y - b->center.y) * (y - b->center.y)) * inv_two_w2;
+                        fast_exp2_array(values, values, n);
+                        for (int y = y_min; y <= y_max; ++y)
+                            row[y] += values[y - y_min] * b->amplitude;
+                        continue;
+                    }
+                    for (int y = y_min; y <= y_max; ++y)
+                    {
+                        double d2 = dx2 + (y - b->center.y) * (y - b->center.y);
+                        row[y] += exp2(-d2 * inv_two_w2) * b->amplitude;
+                    }
+                }
+            }
+        }
+    }
+
+    for (int i = 0; i < tile_rows * tile_cols; ++i)
+        tile[i] *= scale;
+}
+
+/**
+ * Generates a Gaussian boss terrain tile by tile and streams it to a raw file.
+ *
+ * Only the boss list and one tile are kept in memory. The normalization to
+ * 0 - 255 needs the global min & max, so the terrain is generated twice: the
+ * first pass only finds the bounds, the second one normalizes and writes.
+ * The output is row-major native-endian float32, height rows of width values.
+ *
+ * @param filename Path of the raw output file.
+ * @param width Width of the heightmap.
+ * @param height Height of the heightmap.
+ * @param tile_size Side of the square tiles, in cells.
+ * @param seed Seed of the boss draws.
+ * @param num_bosses Number of Gaussian boss peaks to generate.
+ * @param scale Scale factor for the height values.
+ * @param width_range Min and max width of the boss peaks.
+ * @param amplitude_range Min and max amplitude of the boss peaks.
+ * @return int 0 if successful, -1 if there is an error.
+ */
+int generate_heightgaussian_streamed(const char *filename, int width, int height, int tile_size, unsigned int seed, int num_bosses, int scale, vec2 width_range, vec2 amplitude_range)
+{
+    struct boss *bosses = (struct boss *)malloc(num_bosses * sizeof(struct boss));
+    double *tile = (double *)malloc((size_t)tile_size * tile_size * sizeof(double));
+    float *row = (float *)malloc(tile_size * sizeof(float));
+    if (bosses == NULL || tile == NULL || row == NULL)
+    {
+        printf("Memory allocation error for the streamed terrain.\n");
+        free(bosses);
+        free(tile);
+        free(row);
+        return -1;
+    }
+
+    generate_bosses(bosses, num_bosses, seed, width, height, width_range, amplitude_range);
+    struct boss_grid grid;
+    if (boss_grid_build(&grid, bosses, num_bosses, width, height) != 0)
+    {
+        printf("Memory allocation error for the boss grid.\n");
+        free(bosses);
+        free(tile);
+        free(row);
+        return -1;
+    }
+
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || ftruncate(fd, (off_t)width * height * sizeof(float)) != 0)
+    {
+        printf("Error opening the file: %s\n", filename);
+        if (fd >= 0)
+            close(fd);
+        boss_grid_free(&grid);
+        free(bosses);
+        free(tile);
+        free(row);
+        return -1;
+    }
+
+    // pass 0 finds min & max, pass 1 normalizes to 0 - 255 and writes
+    double min = INFINITY;
+    double max = -INFINITY;
+    int result = 0;
+    for (int pass = 0; pass < 2 && result == 0; ++pass)
+    {
+        for (int x0 = 0; x0 < height && result == 0; x0 += tile_size)
+        {
+            for (int y0 = 0; y0 < width && result == 0; y0 += tile_size)
+            {
+                int rows = MIN(tile_size, height - x0);
+                int cols = MIN(tile_size, width - y0);
+                generate_heightgaussian_tile(x0, y0, rows, cols, tile, bosses, &grid, scale);
+
+                if (pass == 0)
+                {
+                    for (int i = 0; i < rows * cols; ++i)
+                    {
+                        if (tile[i] > max)
+                            max = tile[i];
+                        if (tile[i] < min)
+                            min = tile[i];
+                    }
+                    continue;
+                }
+
+                double range = max > min ? max - min : 1.0;
+                for (int x = 0; x < rows; ++x)
+                {
+                    for (int y = 0; y < cols; ++y)
+                        row[y] = (float)((tile[x * cols + y] - min) / range * 255.0);
+
+                    off_t offset = ((off_t)(x0 + x) * width + y0) * sizeof(float);
+                    if (pwrite(fd, row, cols * sizeof(float), offset) != (ssize_t)(cols * sizeof(float)))
+                    {
+                        printf("Error writing the file: %s\n", filename);
+                        result = -1;
+                        break;
+                    }
+                }
+            }
+        }
+    }
+
+    close(fd);
+    boss_grid_free(&grid);
+    free(bosses);
+    free(tile);
+    free(row);
+    if (result == 0)
+        printf("Terrain successfully saved as: %s\n", filename);
+    return result;
+}
+
+enum sample_format {
+    SAMPLE_U8,    // 8-bit integer
+    SAMPLE_U16LE, // 16-bit little endian integer
+    SAMPLE_U16BE, // 16-bit big endian integer (PGM)
+    SAMPLE_F32,   // 32-bit float
+    SAMPLE_F64    // 64-bit float, the in-memory layout
+};
+
+struct sample_conversion {
+    const unsigned char *src; /**< First sample of the file. */
+    double *dst;              /**< Converted heightmap. */
+    int width;                /**< Samples per row. */
+    enum sample_format format;/**< Layout of the samples. */
+    double factor;            /**< Factor applied to integer samples. */
+};
+
+/**
+ * @brief Converts rows [begin, end) of a mapped file to doubles.
+ */
+static void convert_sample_rows(void *arg, int begin, int end)
+{
+    struct sample_conversion *c = (struct sample_conversion *)arg;
+    for (long i = (long)begin * c->width; i < (long)end * c->width; ++i)
+    {
+        switch (c->format)
+        {
+        case SAMPLE_U8:
+            c->dst[i] = c->src[i] * c->factor;
+            break;
+        case SAMPLE_U16LE:
+            c->dst[i] = (c->src[2 * i] | c->src[2 * i + 1] << 8) * c->factor;
+            break;
+        case SAMPLE_U16BE:
+            c->dst[i] = (c->src[2 * i] << 8 | c->src[2 * i + 1]) * c->factor;
+            break;
+        case SAMPLE_F32:
+        {
+            float f;
+            memcpy(&f, c->src + 4 * i, sizeof(float));
+            c->dst[i] = f;
+            break;
+        }
+        case SAMPLE_F64:
+            memcpy(&c->dst[i], c->src + 8 * i, sizeof(double));
+            break;
+        }
+    }
+}
+
+/**
+ * @brief Reads the header of a binary PGM file.
+ *
+ * @param data Mapped file.
+ * @param size Size of the file.
+ * @param width Width read from the header.
+ * @param height Height read from the header.
+ * @param maxval Maximum sample value read from the header.
+ * @return long Offset of the first sample, -1 if the header is invalid or a value is above 1000000.
+ */
+static long parse_pgm_header(const unsigned char *data, size_t size, int *width, int *height, int *maxval)
+{
+    if (size < 2 || data[0] != 'P' || data[1] != '5')
+        return -1;
+
+    long values[3];
+    size_t pos = 2;
+    for (int i = 0; i < 3; ++i)
+    {
+        // skip whitespace and comments
+        while (pos < size && (data[pos] == ' ' || data[pos] == '\t' || data[pos] == '\r' || data[pos] == '\n' || data[pos] == '#'))
+        {
+            if (data[pos] == '#')
+            {
+                while (pos < size && data[pos] != '\n')
+                    pos++;
+            }
+            else
+                pos++;
+        }
+        if (pos >= size || data[pos] < '0' || data[pos] > '9')
+            return -1;
+        values[i] = 0;
+        while (pos < size && data[pos] >= '0' && data[pos] <= '9')
+        {
+            values[i] = values[i] * 10 + (data[pos++] - '0');
+            if (values[i] > 1000000)
+                return -1; // larger than any terrain, and the next digit could overflow
+        }
+    }
+    // a single whitespace separates the header from the samples
+    if (pos >= size || values[0] <= 0 || values[1] <= 0 || values[2] <= 0 || values[2] > 65535)
+        return -1;
+
+    *width = (int)values[0];
+    *height = (int)values[1];
+    *maxval = (int)values[2];
+    return (long)pos + 1;
+}
+
+/**
+ * Loads a heightmap from a binary PGM (8 or 16-bit) or a raw file.
+ *
+ * The file is memory-mapped and converted to doubles in parallel, one band of
+ * rows per thread. Integer samples are rescaled to 0 - 255, like the generated
+ * terrains, floating point samples are kept as is. Raw files are picked by
+ * extension: .r16 (uint16 little endian), .r32 (float32) and .r64 (float64).
+ * .hmap snapshots written by save_heightmap_raw() describe themselves in
+ * their raw_header. Float64 samples already have the in-memory layout: they
+ * stay mapped copy-on-write and are used without any conversion, erosion
+ * never modifies the file.
+ *
+ * @param filename Path of the file to load.
+ * @param width Width of a raw heightmap, 0 to infer a square from the file size.
+ * @param height Height of a raw heightmap, 0 to infer a square from the file size.
+ * @param map Loaded heightmap, released with unload_heightmap().
+ * @return int 0 if successful, -1 if there is an error.
+ */
+int load_heightmap(const char *filename, int width, int height, struct heightmap_file *map)
+{
+    map->data = NULL;
+    map->mapping = NULL;
+    map->mapping_size = 0;
+
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0)
+    {
+        printf("Error opening the file: %s\n", filename);
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    size_t size = (size_t)st.st_size;
+    unsigned char *data = (unsigned char *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        printf("Error mapping the file: %s\n", filename);
+        return -1;
+    }
+
+    // find the sample layout from the header or the extension
+    const char *ext = strrchr(filename, '.');
+    enum sample_format format;
+    double factor = 1.0;
+    long offset = 0;
+    int sample_size;
+    if (ext != NULL && strcmp(ext, ".pgm") == 0)
+    {
+        int maxval;
+        offset = parse_pgm_header(data, size, &width, &height, &maxval);
+        if (offset < 0)
+        {
+            printf("Invalid PGM header: %s\n", filename);
+            munmap(data, size);
+            return -1;
+        }
+        format = maxval < 256 ? SAMPLE_U8 : SAMPLE_U16BE;
+        sample_size = maxval < 256 ? 1 : 2;
+        factor = 255.0 / maxval;
+    }
+    else if (ext != NULL && strcmp(ext, ".hmap") == 0)
+    {
+        struct raw_header header;
+        if (size < sizeof(header))
+        {
+            printf("Invalid raw header: %s\n", filename);
+            munmap(data, size);
+            return -1;
+        }
+        memcpy(&header, data, sizeof(header));
+        if (memcmp(header.magic, "HMAP", 4) != 0 || header.version != 1 || (header.format != RAW_F64 && header.format != RAW_F32 && header.format != RAW_U16))
+        {
+            printf("Invalid raw header: %s\n", filename);
+            munmap(data, size);
+            return -1;
+        }
+        width = (int)header.width;
+        height = (int)header.height;
+        offset = header.header_size;
+        format = header.format == RAW_F64 ? SAMPLE_F64 : header.format == RAW_F32 ? SAMPLE_F32 : SAMPLE_U16LE;
+        sample_size = header.format == RAW_F64 ? 8 : header.format == RAW_F32 ? 4 : 2;
+        factor = header.scale;
+    }
+    else if (ext != NULL && (strcmp(ext, ".r16") == 0 || strcmp(ext, ".r32") == 0 || strcmp(ext, ".r64") == 0))
+    {
+        format = ext[2] == '1' ? SAMPLE_U16LE : ext[2] == '3' ? SAMPLE_F32 : SAMPLE_F64;
+        sample_size = ext[2] == '1' ? 2 : ext[2] == '3' ? 4 : 8;
+        factor = 255.0 / 65535.0;
+        if (width == 0 || height == 0)
+        {
+            width = (int)sqrt((double)(size / sample_size));
+            height = width;
+        }
+    }
+    else
+    {
+        printf("Unknown heightmap format: %s\n", filename);
+        munmap(data, size);
+        return -1;
+    }
+
+    if ((size_t)offset + (size_t)width * height * sample_size > size || width <= 0 || height <= 0)
+    {
+        printf("File too small for a %dx%d heightmap: %s\n", width, height, filename);
+        munmap(data, size);
+        return -1;
+    }
+    map->width = width;
+    map->height = height;
+
+    // zero copy: the mapping already holds doubles
+    if (format == SAMPLE_F64 && offset % sizeof(double) == 0)
+    {
+        map->data = (double *)(data + offset);
+        map->mapping = data;
+        map->mapping_size = size;
+        return 0;
+    }
+
+    map->data = (double *)malloc((size_t)width * height * sizeof(double));
+    if (map->data == NULL)
+    {
+        printf("Memory allocation error for the heightmap.\n");
+        munmap(data, size);
+        return -1;
+    }
+    madvise(data, size, MADV_SEQUENTIAL);
+    struct sample_conversion conversion = {data + offset, map->data, width, format, factor};
+    parallel_rows(height, convert_sample_rows, &conversion);
+    munmap(data, size);
+    return 0;
+}
+
+/**
+ * Releases a heightmap loaded with load_heightmap().
+ *
+ * @param map The loaded heightmap.
+ */
+void unload_heightmap(struct heightmap_file *map)
+{
+    if (map->mapping != NULL)
+        munmap(map->mapping, map->mapping_size);
+    else
+        free(map->data);
+    map->data = NULL;
+    map->mapping = NULL;
+    map->mapping_size = 0;
+}
+
+/**
+ * Measures the speed and the accuracy of the fast exp2 kernels against libm,
+ * alone and inside the terrain generator, and prints the results.
+ *
+ * @param width Width of the heightmap.
+ * @param height Height of the heightmap.
+ * @param num_bosses Number of Gaussian boss peaks to generate.
+ * @param scale Scale factor for the height values.
+ * @param width_range Min and max width of the boss peaks.
+ * @param amplitude_range Min and max amplitude of the boss peaks.
+ * @param seed Seed of the terrain.
+ */
+void benchmark_fast_exp2(int width, int height, int num_bosses, int scale, vec2 width_range, vec2 amplitude_range, unsigned int seed)
+{
+    // kernels alone, over the exponents the generator produces
+    int n = 1 << 22;
+    double *x = (double *)malloc(n * sizeof(double));
+    double *ref = (double *)malloc(n * sizeof(double));
+    double *fast = (double *)malloc(n * sizeof(double));
+    float *xf = (float *)malloc(n * sizeof(float));
+    float *fastf = (float *)malloc(n * sizeof(float));
+    if (x == NULL || ref == NULL || fast == NULL || xf == NULL || fastf == NULL)
+    {
+        printf("Memory allocation error for the benchmark.\n");
+        free(x);
+        free(ref);
+        free(fast);
+        free(xf);
+        free(fastf);
+        return;
+    }
+    for (int i = 0; i < n; ++i)
+    {
+        x[i] = -BOSS_CUTOFF * BOSS_CUTOFF / 2 * i / n;
+        xf[i] = (float)x[i];
+    }
+    // fault the output pages in before timing
+    memset(ref, 0, n * sizeof(double));
+    memset(fast, 0, n * sizeof(double));
+    memset(fastf, 0, n * sizeof(float));
+
+    double t0 = get_time();
+    for (int i = 0; i < n; ++i)
+        ref[i] = exp2(x[i]);
+    double t_libm = get_time() - t0;
+    t0 = get_time();
+    fast_exp2_array(fast, x, n);
+    double t_fast = get_time() - t0;
+    t0 = get_time();
+    fast_exp2f_array(fastf, xf, n);
+    double t_fastf = get_time() - t0;
+
+    double err = 0.0;
+    double errf = 0.0;
+    for (int i = 0; i < n; ++i)
+    {
+        err = MAX(fabs(fast[i] - ref[i]) / ref[i], err);
+        errf = MAX(fabs(fastf[i] - exp2(xf[i])) / exp2(xf[i]), errf);
+    }
+    printf("exp2 libm:  %.2f ns/value\n", t_libm * 1e9 / n);
+    printf("exp2 fast:  %.2f ns/value (x%.1f), max relative error %.3g\n", t_fast * 1e9 / n, t_libm / t_fast, err);
+    printf("exp2f fast: %.2f ns/value (x%.1f), max relative error %.3g\n", t_fastf * 1e9 / n, t_libm / t_fastf, errf);
+
+    free(x);
+    free(ref);
+    free(fast);
+    free(xf);
+    free(fastf);
+
+    // whole generator, same bosses with and without the fast kernel
+    double *libm_map = (double *)malloc((size_t)width * height * sizeof(double));
+    double *fast_map = (double *)malloc((size_t)width * height * sizeof(double));
+    struct boss *bosses = (struct boss *)malloc(num_bosses * sizeof(struct boss));
+    struct boss_grid grid;
+    if (libm_map == NULL || fast_map == NULL || bosses == NULL)
+    {
+        printf("Memory allocation error for the benchmark.\n");
+        free(libm_map);
+        free(fast_map);
+        free(bosses);
+        return;
+    }
+    generate_bosses(bosses, num_bosses, seed, width, height, width_range, amplitude_range);
+    if (boss_grid_build(&grid, bosses, num_bosses, width, height) != 0)
+    {
+        printf("Memory allocation error for the boss grid.\n");
+        free(libm_map);
+        free(fast_map);
+        free(bosses);
+        return;
+    }
+
+    int saved = fast_math;
+    double times[2];
+    for (int pass = 0; pass < 2; ++pass)
+    {
+        set_fast_math(pass);
+        t0 = get_time();
+        generate_heightgaussian_tile(0, 0, height, width, pass ? fast_map : libm_map, bosses, &grid, scale);
+        times[pass] = get_time() - t0;
+    }
+    set_fast_math(saved);
+
+    double map_err = 0.0;
+    for (long i = 0; i < (long)width * height; ++i)
+        map_err = MAX(fabs(fast_map[i] - libm_map[i]) / MAX(fabs(libm_map[i]), EPSILON), map_err);
+    printf("generator libm: %.3f s, fast: %.3f s (x%.1f), max relative error %.3g\n", times[0], times[1], times[0] / times[1], map_err);
+
+    boss_grid_free(&grid);
+    free(libm_map);
+    free(fast_map);
+    free(bosses);
+}
+
+/**
+ * Checks that residual frames decode exactly: the same run is simulated
+ * twice, into an archive of keyframes only and into one with residual frames,
+ * and every frame of both is decoded and compared, the last one with the
+ * heightmap simulated up to it as well. Prints the sizes of both archives
+ * for each PNG format.
+ *
+ * @param width Width of the heightmap.
+ * @param height Height of the heightmap.
+ * @param num_bosses Number of Gaussian boss peaks to generate.
+ * @param scale Scale factor for the height values.
+ * @param width_range Min and max width of the boss peaks.
+ * @param amplitude_range Min and max amplitude of the boss peaks.
+ * @param seed Seed of the terrain and of the drops.
+ * @return int 0 if every frame matches, -1 otherwise.
+ */
+int check_residual_frames(int width, int height, int num_bosses, int scale, vec2 width_range, vec2 amplitude_range, unsigned int seed)
+{
+    static const enum image_format formats[3] = {IMAGE_GRAY8, IMAGE_GRAY16, IMAGE_RGB8};
+    static const char *names[3] = {"gray8", "gray16", "rgb8"};
+    struct parameters param = {0.1, 0.001, 32, 0.03, 0.1, 9.81, 0.002, 4};
+    int nb_drop = 20000, save_every = 1000;
+    size_t nb_cells = (size_t)width * height;
+    double *original = (double *)malloc(nb_cells * sizeof(double));
+    double *heightmap = (double *)malloc(nb_cells * sizeof(double));
+    double *last = (double *)malloc(nb_cells * sizeof(double));
+    unsigned char *last_samples = (unsigned char *)malloc(nb_cells * 3);
+    if (original == NULL || heightmap == NULL || last == NULL || last_samples == NULL)
+    {
+        printf("Memory allocation error for the residual check.\n");
+        free(original);
+        free(heightmap);
+        free(last);
+        free(last_samples);
+        return -1;
+    }
+    generate_random_heightgaussian(width, height, (double(*)[height])original, num_bosses, scale, width_range, amplitude_range, seed);
+
+    // the last snapshot is taken before drop nb_drop: the same drops without snapshots stop there
+    struct run_options plain = {.seed = seed};
+    memcpy(last, original, nb_cells * sizeof(double));
+    simulate_erosion_detailed(height, width, (double(*)[height])last, param, nb_drop - 1, "", nb_drop, &plain);
+
+    int failures = 0;
+    for (int k = 0; k < 3; ++k)
+    {
+        // the same run with keyframes only, then with residual frames
+        struct frame_archive archives[2];
+        char filenames[2][64];
+        int opened = 0;
+        for (int a = 0; a < 2; ++a)
+        {
+            struct run_options options = {.format = formats[k], .profile = PNG_FAST, .keyframe_interval = a == 0 ? 0 : 5, .seed = seed, .run_id = 1};
+            snprintf(filenames[a], sizeof(filenames[a]), "/tmp/residual_check_XXXXXX");
+            int fd = mkstemp(filenames[a]);
+            if (fd < 0 || archive_open(&archives[a], filenames[a], width, height, &options) != 0)
+            {
+                if (fd >= 0)
+                {
+                    close(fd);
+                    unlink(filenames[a]);
+                }
+                break;
+            }
+            close(fd);
+            ++opened;
+            options.archive = &archives[a];
+            memcpy(heightmap, original, nb_cells * sizeof(double));
+            simulate_erosion_detailed(height, width, (double(*)[height])heightmap, param, nb_drop, "", save_every, &options);
+        }
+
+        int nb_frames = opened == 2 ? archives[0].count : 0;
+        int matching = opened == 2 && archives[1].count == nb_frames ? 0 : -1;
+        heightmap_to_pixels(last, width, 0, 0, width - 1, height - 1, formats[k], last_samples);
+        for (int i = 0; i < nb_frames && matching >= 0; ++i)
+        {
+            size_t expected_size, size;
+            unsigned char *expected = archive_decode_frame(&archives[0], i, &expected_size);
+            unsigned char *samples = archive_decode_frame(&archives[1], i, &size);
+            if (expected != NULL && samples != NULL && size == expected_size && memcmp(samples, expected, size) == 0
+                && (i < nb_frames - 1 || memcmp(samples, last_samples, size) == 0))
+                ++matching;
+            else
+                matching = -1;
+            free(expected);
+            free(samples);
+        }
+        if (opened == 2)
+            printf("Residual frames %s: %d frames, %.1f kB as keyframes, %.1f kB with residuals, %s\n", names[k], nb_frames,
+                   archives[0].end / 1e3, archives[1].end / 1e3, matching == nb_frames && nb_frames > 0 ? "decoded exactly" : "MISMATCH");
+        else
+            printf("Error opening the archives of the residual check.\n");
+        failures += matching != nb_frames || nb_frames == 0;
+
+        for (int a = 0; a < opened; ++a)
+        {
+            archive_close(&archives[a]);
+            unlink(filenames[a]);
+        }
+    }
+    free(original);
+    free(heightmap);
+    free(last);
+    free(last_samples);
+    return failures == 0 ? 0 : -1;
+}
+
+/**
+ * Copies the heightmap from the source to the destination.
+ *
+ * @param w Width of the heightmap.
+ * @param h Height of the heightmap.
+ * @param dest Destination 2D array for the copied heightmap.
+ * @param src Source 2D array to copy from.
+ */
+void copy_heightmap(int w, int h, double dest[w][h], double src[w][h])
+{
+    for (int i = 0; i < w; ++i)
+    {
+        for (int j = 0; j < h; ++j)
+        {
+            dest[i][j] = src[i][j];
+        }
+    }
+}
+
+/**
+ * Generates a directory name by appending an index to the base directory name.
+ *
+ * @param dest The destination string to store the generated directory name.
+ * @param i Index to append to the directory name.
+ * @param name Base directory name.
+ */
+void name_directory(char *dest, int i, char *name)
+{
+    char dec[4];
+    sprintf(dec, "_%d/", i);
+    strcat(dest, dec);
+    strcat(dest, name);
+}
+
+struct sweep_job {
+    struct parameters param; /**< Erosion parameters of the run. */
+    char path[1024];         /**< Prefix of the snapshot files of the run. */
+    uint64_t key;            /**< Hash of everything the outputs of the run depend on. */
+    int duplicate_of;        /**< Earlier run with the same key whose outputs are reused, -1 for none. */
+};
+
+struct sweep_pool {
+    const double *original;     /**< Terrain every run starts from, after the warm-up; shared read-only. */
+    int width;                  /**< Width of the heightmap. */
+    int height;                 /**< Height of the heightmap. */
+    int nb_drop;                /**< Number of drops of each run. */
+    int modulo_save_image;      /**< Drops between two snapshots. */
+    struct run_options options; /**< Output options of the runs, run_id is set per job. */
+    struct sweep_job *jobs;     /**< Runs of the sweep, run ids numbered from 1 in this order. */
+    int nb_jobs;                /**< Number of runs. */
+    const char *cache;          /**< Directory of the result cache, NULL for none. */
+    int first_drop;             /**< First drop of the runs, original being the state before it; 0 for all of them. */
+    int next;                   /**< Next run to start. */
+    pthread_mutex_t lock;       /**< Protects next. */
+};
+
+/**
+ * Adds a run to the sweep and prints its run id. The snapshots of the run
+ * go in dir_path/name_i/name.
+ *
+ * @param jobs Runs of the sweep.
+ * @param nb_jobs Number of runs, incremented.
+ * @param dir_path Base directory path to store results.
+ * @param name Name of the parameter the run varies.
+ * @param i Index of the value of the parameter.
+ * @param p Erosion parameters of the run.
+ */
+static void add_sweep_job(struct sweep_job *jobs, int *nb_jobs, const char *dir_path, const char *name, int i, struct parameters p)
+{
+    struct sweep_job *job = &jobs[(*nb_jobs)++];
+    job->param = p;
+    job->key = 0;
+    job->duplicate_of = -1;
+    snprintf(job->path, sizeof(job->path), "%s/%s_%d/%s", dir_path, name, i, name);
+    printf("Run %d: %s\n", *nb_jobs, job->path);
+}
+
+/**
+ * @brief Returns the key of the outputs of a run: a hash of the terrain, the
+ * first drop, the parameters, the drop count, the snapshot cadence, the seed
+ * and the output format.
+ *
+ * @param terrain_hash Hash of the terrain the run starts from.
+ * @param first_drop First drop of the run, after a warm-up.
+ * @param param Erosion parameters of the run.
+ * @param nb_drop Number of drops of the run.
+ * @param save_every Drops between two snapshots.
+ * @param options Output options of the run, seed included.
+ * @return uint64_t The key.
+ */
+static uint64_t sweep_cache_key(uint64_t terrain_hash, int first_drop, const struct parameters *param, int nb_drop, int save_every, const struct run_options *options)
+{
+    uint64_t values[] = {terrain_hash, (uint64_t)first_drop, sweep_run_key(param, nb_drop, save_every), options->seed, options->format,
+                         options->profile, (uint64_t)options->keyframe_interval, (uint64_t)options->converge_windows};
+    uint64_t key = fnv1a64(0xcbf29ce484222325ull, values, sizeof(values));
+    key = fnv1a64(key, &options->converge_l1, sizeof(double));
+    return fnv1a64(key, &options->converge_linf, sizeof(double));
+}
+
+/**
+ * @brief Orders runs by key, then by run id.
+ */
+static int compare_sweep_keys(const void *a, const void *b)
+{
+    const uint64_t *x = (const uint64_t *)a;
+    const uint64_t *y = (const uint64_t *)b;
+    if (x[0] != y[0])
+        return x[0] < y[0] ? -1 : 1;
+    return x[1] < y[1] ? -1 : x[1] > y[1];
+}
+
+/**
+ * @brief Points every run to the first earlier run with the same key.
+ *
+ * @param jobs Runs of the sweep, keys set.
+ * @param nb_jobs Number of runs.
+ * @return int Number of duplicates, -1 on allocation error.
+ */
+static int mark_duplicate_runs(struct sweep_job *jobs, int nb_jobs)
+{
+    uint64_t *pairs = (uint64_t *)malloc(MAX(nb_jobs, 1) * 2 * sizeof(uint64_t));
+    if (pairs == NULL)
+        return -1;
+    for (int j = 0; j < nb_jobs; ++j)
+    {
+        pairs[2 * j] = jobs[j].key;
+        pairs[2 * j + 1] = (uint64_t)j;
+    }
+    qsort(pairs, nb_jobs, 2 * sizeof(uint64_t), compare_sweep_keys);
+
+    int nb_duplicates = 0;
+    for (int i = 1; i < nb_jobs; ++i)
+    {
+        int first = i;
+        while (first > 0 && pairs[2 * (first - 1)] == pairs[2 * i])
+            --first;
+        if (first < i)
+        {
+            jobs[pairs[2 * i + 1]].duplicate_of = (int)pairs[2 * first + 1];
+            ++nb_duplicates;
+        }
+    }
+    free(pairs);
+    return nb_duplicates;
+}
+
+/**
+ * @brief Copies the frames of a cached run into the sweep archive.
+ *
+ * @param cache Directory of the cache.
+ * @param key Key of the run.
+ * @param archive Archive of the sweep.
+ * @param run_id Run id of the frames in the sweep archive.
+ * @return int 0 if the run was in the cache, -1 otherwise.
+ */
+static int cache_fetch(const char *cache, uint64_t key, struct frame_archive *archive, int run_id)
+{
+    char path[1100];
+    struct frame_archive cached;
+    snprintf(path, sizeof(path), "%s/%016llx.harc", cache, (unsigned long long)key);
+    if (access(path, R_OK) != 0 || archive_open_read(&cached, path, archive->width, archive->height) != 0)
+        return -1;
+    int nb_frames = archive_copy_run(archive, run_id, &cached, 1);
+    archive_close(&cached);
+    return nb_frames > 0 ? 0 : -1;
+}
+
+/**
+ * @brief Saves the frames of a completed run in the cache, as run 1 of
+ * cache/key.harc. The file is written aside and renamed, so a cached run is
+ * always complete.
+ *
+ * @param cache Directory of the cache.
+ * @param key Key of the run.
+ * @param archive Archive of the sweep.
+ * @param run_id Run id of the frames in the sweep archive.
+ */
+static void cache_store(const char *cache, uint64_t key, struct frame_archive *archive, int run_id)
+{
+    char tmp[1200], path[1100];
+    struct frame_archive cached;
+    struct run_options options = {.format = archive->format, .profile = archive->profile};
+    snprintf(path, sizeof(path), "%s/%016llx.harc", cache, (unsigned long long)key);
+    snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int)getpid());
+    unlink(tmp);
+    if (create_directories(cache) != 0 || archive_open(&cached, tmp, archive->width, archive->height, &options) != 0)
+        return;
+    int nb_frames = archive_copy_run(&cached, 1, archive, run_id);
+    if (archive_close(&cached) == 0 && nb_frames > 0 && rename(tmp, path) == 0)
+        return;
+    printf("Error storing run %d in the cache %s.\n", run_id, cache);
+    unlink(tmp);
+}
+
+/**
+ * @brief Records in the journal that a run completed, if there is a journal.
+ *
+ * @param options Output options of the run.
+ * @param run_id The run.
+ */
+static void record_run_done(const struct run_options *options, int run_id)
+{
+    if (options->journal == NULL)
+        return;
+    int last_drop = 0;
+    if (options->archive != NULL)
+        archive_run_last_drop(options->archive, run_id, &last_drop);
+    journal_done(options->journal, run_id, last_drop);
+}
+
+/**
+ * @brief Gives a duplicate run the outputs of the run it duplicates: hard
+ * links to its final states, copies of its metrics, aliases of its frames in
+ * the archive, hard links to its snapshot files otherwise.
+ *
+ * @param pool The sweep pool, after the runs.
+ * @param j Index of the duplicate run.
+ */
+static void link_duplicate_run(struct sweep_pool *pool, int j)
+{
+    const struct sweep_job *job = &pool->jobs[j];
+    const struct sweep_job *source = &pool->jobs[job->duplicate_of];
+    const struct run_options *options = &pool->options;
+    printf("Run %d: same as run %d\n", j + 1, job->duplicate_of + 1);
+    for (int f = 0; f < options->nb_final_drops; ++f)
+    {
+        char from[1100], to[1100];
+        snprintf(from, sizeof(from), "%s_final_%d.hmap", source->path, options->final_drops[f]);
+        snprintf(to, sizeof(to), "%s_final_%d.hmap", job->path, options->final_drops[f]);
+        unlink(to);
+        if (create_parent_directories(to) != 0 || link(from, to) != 0)
+            printf("Error linking %s to %s: %s\n", to, from, strerror(errno));
+    }
+    if (options->metrics != NULL)
+        metrics_copy_run(options->metrics, j + 1, job->duplicate_of + 1);
+    if (options->metrics_only)
+        return;
+    if (options->archive != NULL)
+    {
+        int last_drop;
+        if (archive_run_last_drop(options->archive, j + 1, &last_drop) == 0) // already aliased when a resumed sweep runs again
+            archive_alias_run(options->archive, j + 1, job->duplicate_of + 1);
+        return;
+    }
+
+    int animated = options->animated && strcmp(format_extension(options->format), ".png") == 0;
+    int first = MAX(pool->first_drop, 1);
+    for (int i = (first + pool->modulo_save_image - 1) / pool->modulo_save_image * pool->modulo_save_image; i <= pool->nb_drop; i += pool->modulo_save_image)
+    {
+        char from[1100], to[1100];
+        if (animated)
+        {
+            snprintf(from, sizeof(from), "%s.png", source->path);
+            snprintf(to, sizeof(to), "%s.png", job->path);
+        }
+        else
+        {
+            snprintf(from, sizeof(from), "%s%d%s", source->path, i, format_extension(options->format));
+            snprintf(to, sizeof(to), "%s%d%s", job->path, i, format_extension(options->format));
+        }
+        if (access(from, F_OK) != 0 && options->converge_windows > 0)
+            break; // the run converged before this snapshot
+        unlink(to);
+        if (create_parent_directories(to) != 0 || link(from, to) != 0)
+            printf("Error linking %s to %s: %s\n", to, from, strerror(errno));
+        if (animated)
+            break;
+    }
+}
+
+/**
+ * @brief Reads the checkpoint of a run back into a heightmap.
+ *
+ * @param journal The journal.
+ * @param run_id The run.
+ * @param heightmap Destination, journal->width * journal->height values.
+ * @return int 0 if successful, -1 if there is an error.
+ */
+static int load_checkpoint(const struct sweep_journal *journal, int run_id, double *heightmap)
+{
+    char path[1200];
+    struct heightmap_file map;
+    checkpoint_path(journal, run_id, "", path, sizeof(path));
+    if (load_heightmap(path, 0, 0, &map) != 0)
+        return -1;
+    int valid = map.width == journal->width && map.height == journal->height;
+    if (valid)
+        memcpy(heightmap, map.data, (size_t)map.width * map.height * sizeof(double));
+    else
+        printf("Error: the checkpoint %s does not match the sweep.\n", path);
+    unload_heightmap(&map);
+    return valid ? 0 : -1;
+}
+
+/**
+ * @brief Loads the starting state of a run of a sweep: the shared original,
+ * or the last checkpoint of a resumed run.
+ *
+ * @param pool The sweep pool.
+ * @param j Index of the run.
+ * @param heightmap Set to the starting state of the run; pool->original itself
+ *        in a forked child, whose pages are its own once written.
+ * @param options Output options of the run, first drop set.
+ */
+static void load_sweep_start(struct sweep_pool *pool, int j, double *heightmap, struct run_options *options)
+{
+    struct sweep_journal *journal = pool->options.journal;
+    if (heightmap != pool->original)
+        memcpy(heightmap, pool->original, (size_t)pool->width * pool->height * sizeof(double));
+    options->first_drop = pool->first_drop;
+    if (journal != NULL && journal->checkpoints[j] > options->first_drop && load_checkpoint(journal, j + 1, heightmap) == 0)
+    {
+        options->first_drop = journal->checkpoints[j];
+        printf("Run %d: resumed at drop %d\n", j + 1, options->first_drop);
+    }
+}
+
+/**
+ * @brief Prepares a run of a sweep: skips it when its outputs already exist,
+ * otherwise loads its starting state.
+ *
+ * @param pool The sweep pool.
+ * @param j Index of the run.
+ * @param heightmap Set to the starting state of the run, NULL to leave it to load_sweep_start().
+ * @param options Set to the output options of the run, first drop included.
+ * @return int 1 if the run has to be simulated, 0 otherwise.
+ */
+static int prepare_sweep_run(struct sweep_pool *pool, int j, double *heightmap, struct run_options *options)
+{
+    struct sweep_journal *journal = pool->options.journal;
+    *options = pool->options;
+    options->run_id = j + 1;
+    if (pool->jobs[j].duplicate_of >= 0)
+        return 0; // outputs linked once the sweep is over
+    if (journal != NULL && journal->done[j])
+    {
+        printf("Run %d: already done\n", j + 1);
+        return 0;
+    }
+    if (pool->cache != NULL && options->archive != NULL && cache_fetch(pool->cache, pool->jobs[j].key, options->archive, j + 1) == 0)
+    {
+        printf("Run %d: from the cache\n", j + 1);
+        record_run_done(options, j + 1);
+        return 0;
+    }
+    if (heightmap != NULL)
+        load_sweep_start(pool, j, heightmap, options);
+    return 1;
+}
+
+/**
+ * Worker of a sweep: runs the next configuration until there are none left.
+ *
+ * Each worker owns one heightmap buffer, reset from the shared original
+ * before every run. Runs are taken one at a time, so long runs (large
+ * radius) do not hold back the others. With a journal, completed runs are
+ * skipped and the others restart from their last checkpoint.
+ *
+ * @param arg The sweep pool.
+ */
+static void *sweep_worker_main(void *arg)
+{
+    struct sweep_pool *pool = (struct sweep_pool *)arg;
+    double *heightmap = (double *)malloc((size_t)pool->width * pool->height * sizeof(double));
+    if (heightmap == NULL)
+    {
+        printf("Memory allocation error for a sweep worker.\n");
+        return NULL;
+    }
+
+    while (1)
+    {
+        pthread_mutex_lock(&pool->lock);
+        int j = pool->next++;
+        pthread_mutex_unlock(&pool->lock);
+        if (j >= pool->nb_jobs)
+            break;
+
+        struct run_options options;
+        if (!prepare_sweep_run(pool, j, heightmap, &options))
+            continue;
+        simulate_erosion_detailed(pool->height, pool->width, (double(*)[pool->height])heightmap, pool->jobs[j].param,
+                                  pool->nb_drop, pool->jobs[j].path, pool->modulo_save_image, &options);
+        if (pool->cache != NULL && options.archive != NULL)
+            cache_store(pool->cache, pool->jobs[j].key, options.archive, j + 1);
+        record_run_done(&options, j + 1);
+    }
+    free(heightmap);
+    return NULL;
+}
+
+/**
+ * Runs the jobs of a sweep on one worker per processor, the calling thread included.
+ *
+ * @param pool The sweep pool, next is reset.
+ * @return int Number of threads used.
+ */
+static int run_sweep(struct sweep_pool *pool)
+{
+    int nb_threads = MIN(get_nb_threads(), MAX(pool->nb_jobs, 1));
+    pthread_t threads[nb_threads];
+    int started[nb_threads];
+
+    pool->next = 0;
+    pthread_mutex_init(&pool->lock, NULL);
+    for (int t = 1; t < nb_threads; ++t)
+        started[t] = pthread_create(&threads[t], NULL, sweep_worker_main, pool) == 0;
+    sweep_worker_main(pool);
+    for (int t = 1; t < nb_threads; ++t)
+    {
+        if (started[t])
+            pthread_join(threads[t], NULL);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    return nb_threads;
+}
+
+/**
+ * @brief Simulates one run of a sweep in a forked child and exits.
+ *
+ * The child erodes pool->original in place: the pages it writes are copied
+ * by the kernel, the others stay shared with the parent and the other
+ * children. Its frames go in job.harc, next to its files, merged into the
+ * sweep archive by the parent once the child exited.
+ *
+ * @param pool The sweep pool.
+ * @param j Index of the run.
+ * @param options Output options of the run.
+ */
+static void sweep_child_main(struct sweep_pool *pool, int j, struct run_options *options)
+{
+    double *heightmap = (double *)pool->original;
+    struct sweep_job *job = &pool->jobs[j];
+    struct frame_archive archive;
+    char path[1100];
+    int status = 0;
+
+    load_sweep_start(pool, j, heightmap, options);
+    if (options->archive != NULL)
+    {
+        // a resumed run keeps the frames before its checkpoint
+        snprintf(path, sizeof(path), "%s.harc", job->path);
+        if (options->first_drop == pool->first_drop)
+            unlink(path);
+        options->archive = NULL;
+        if (create_parent_directories(path) == 0 && archive_open(&archive, path, pool->width, pool->height, &pool->options) == 0)
+            options->archive = &archive;
+        else
+            status = 1;
+    }
+    if (status == 0)
+    {
+        simulate_erosion_detailed(pool->height, pool->width, (double(*)[pool->height])heightmap, job->param,
+                                  pool->nb_drop, job->path, pool->modulo_save_image, options);
+        if (pool->cache != NULL && options->archive != NULL)
+            cache_store(pool->cache, job->key, options->archive, j + 1);
+    }
+    if (options->archive != NULL && archive_close(&archive) != 0)
+        status = 1;
+    fflush(stdout);
+    _exit(status);
+}
+
+/**
+ * @brief Collects a child of run_sweep_processes(): merges its frames into the
+ * sweep archive and records the run as done if it succeeded.
+ *
+ * @param pool The sweep pool.
+ * @param j Index of the run of the child.
+ * @param status Status of the child, from waitpid().
+ */
+static void reap_sweep_child(struct sweep_pool *pool, int j, int status)
+{
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+        if (WIFSIGNALED(status))
+            printf("Run %d failed: killed by signal %d\n", j + 1, WTERMSIG(status));
+        else
+            printf("Run %d failed: exit status %d\n", j + 1, WEXITSTATUS(status));
+        return;
+    }
+    if (pool->options.archive != NULL)
+    {
+        char path[1100];
+        struct frame_archive archive;
+        snprintf(path, sizeof(path), "%s.harc", pool->jobs[j].path);
+        if (archive_open_read(&archive, path, pool->width, pool->height) != 0)
+            return;
+        int nb_frames = archive_copy_run(pool->options.archive, j + 1, &archive, j + 1);
+        archive_close(&archive);
+        if (nb_frames < 0)
+            return;
+        unlink(path);
+    }
+    record_run_done(&pool->options, j + 1);
+}
+
+/**
+ * Runs the jobs of a sweep in forked child processes, one run per child and
+ * one child per processor.
+ *
+ * Every child starts from the pages of pool->original, shared copy-on-write:
+ * a run only pays for the memory it erodes, and a run that crashes takes
+ * none of the others with it; the parent reports it and the journal keeps
+ * it to resume. Snapshots, checkpoints and metrics are written by the
+ * children, through files opened with O_APPEND or their own archive.
+ *
+ * @param pool The sweep pool.
+ * @return int Number of processes used.
+ */
+static int run_sweep_processes(struct sweep_pool *pool)
+{
+    int nb_processes = MIN(get_nb_threads(), MAX(pool->nb_jobs, 1));
+    pid_t pids[nb_processes];
+    int runs[nb_processes];
+    int nb_running = 0;
+    int j = 0;
+
+    while (j < pool->nb_jobs || nb_running > 0)
+    {
+        if (j < pool->nb_jobs && nb_running < nb_processes)
+        {
+            struct run_options options;
+            if (!prepare_sweep_run(pool, j, NULL, &options))
+            {
+                ++j;
+                continue;
+            }
+            fflush(stdout); // the child would print the buffered lines again
+            pid_t pid = fork();
+            if (pid == 0)
+                sweep_child_main(pool, j, &options);
+            if (pid > 0)
+            {
+                pids[nb_running] = pid;
+                runs[nb_running++] = j++;
+                continue;
+            }
+            printf("Error forking run %d: %s\n", j + 1, strerror(errno));
+            if (nb_running == 0)
+                return nb_processes;
+        }
+
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid < 0)
+        {
+            printf("Error waiting for the sweep processes: %s\n", strerror(errno));
+            return nb_processes;
+        }
+        for (int p = 0; p < nb_running; ++p)
+        {
+            if (pids[p] == pid)
+            {
+                reap_sweep_child(pool, runs[p], status);
+                pids[p] = pids[--nb_running];
+                runs[p] = runs[nb_running];
+                break;
+            }
+        }
+    }
+    return nb_processes;
+}
+
+static const char *sweep_parameter_names[SWEEP_PARAMETERS] = {"inertia", "slope", "capacity", "deposition", "erosion", "gravity", "evaporation", "radius"};
+static const char *metric_names[] = {"mean", "min", "max", "eroded", "deposited", "mean_slope", "roughness", "drainage"};
+
+/**
+ * @brief Returns the index of a metric in metric_names.
+ *
+ * @param name Name of the metric, a field of struct heightmap_metrics.
+ * @return int Index of the metric, -1 if there is none by that name.
+ */
+static int metric_index(const char *name)
+{
+    for (int k = 0; k < 8; ++k)
+    {
+        if (strcmp(name, metric_names[k]) == 0)
+            return k;
+    }
+    return -1;
+}
+
+/**
+ * @brief Returns a metric by its index in metric_names.
+ */
+static double metric_value(const struct heightmap_metrics *m, int k)
+{
+    switch (k)
+    {
+    case 0: return m->mean;
+    case 1: return m->min;
+    case 2: return m->max;
+    case 3: return m->eroded;
+    case 4: return m->deposited;
+    case 5: return m->mean_slope;
+    case 6: return m->roughness;
+    default: return m->drainage;
+    }
+}
+
+/**
+ * @brief Sets one erosion parameter by its index in sweep_parameter_names.
+ *
+ * @param p Erosion parameters.
+ * @param k Index of the parameter.
+ * @param value New value, rounded for the radius.
+ */
+static void set_sweep_parameter(struct parameters *p, int k, double value)
+{
+    switch (k)
+    {
+    case 0: p->inertia = value; break;
+    case 1: p->slope = value; break;
+    case 2: p->capacity = value; break;
+    case 3: p->deposition = value; break;
+    case 4: p->erosion = value; break;
+    case 5: p->gravity = value; break;
+    case 6: p->evaporation = value; break;
+    case 7: p->radius = (int)lround(value); break;
+    }
+}
+
+/**
+ * @brief Returns the index of an erosion parameter in sweep_parameter_names.
+ *
+ * @param name Name of the parameter.
+ * @return int Index of the parameter, -1 if there is none by that name.
+ */
+static int sweep_parameter_index(const char *name)
+{
+    for (int k = 0; k < SWEEP_PARAMETERS; ++k)
+    {
+        if (strcmp(name, sweep_parameter_names[k]) == 0)
+            return k;
+    }
+    return -1;
+}
+
+/**
+ * @brief Replaces the values a parameter takes in a sweep.
+ *
+ * @param spec The specification.
+ * @param k Index of the parameter.
+ * @param values Values of the parameter, copied.
+ * @param nb_values Number of values.
+ * @return int 0 if successful, -1 if there is an error.
+ */
+static int sweep_spec_set_values(struct sweep_spec *spec, int k, const double *values, int nb_values)
+{
+    double *copy = (double *)malloc(MAX(nb_values, 1) * sizeof(double));
+    if (copy == NULL)
+    {
+        printf("Memory allocation error for the values of %s.\n", sweep_parameter_names[k]);
+        return -1;
+    }
+    memcpy(copy, values, nb_values * sizeof(double));
+
+    if (spec->values[k] == NULL)
+        spec->order[spec->nb_swept++] = k;
+    free(spec->values[k]);
+    spec->values[k] = copy;
+    spec->nb_values[k] = nb_values;
+    return 0;
+}
+
+void sweep_spec_default(struct sweep_spec *spec)
+{
+    struct run_options options = RUN_OPTIONS_DEFAULT;
+    options.profile = PNG_FAST;     // intermediate frames, keep the original archival
+    options.keyframe_interval = 20; // residual frames in between, lossless
+
+    memset(spec, 0, sizeof(*spec));
+    spec->mode = SWEEP_ONE_AT_A_TIME;
+    strcpy(spec->output, "./image");
+    spec->width = 512;
+    spec->height = 512;
+    spec->num_bosses = 500;
+    spec->terrain_seed = TERRAIN_SEED_DEFAULT;
+    spec->scale = 10;
+    spec->width_range = (vec2){5.0, 20.0};
+    spec->amplitude_range = (vec2){1.0, 15.0};
+    spec->nb_drop = 100000;
+    spec->save_every = 1000;
+    spec->checkpoint_every = 10000;
+    spec->images = 1;
+    spec->top_k = 4;
+    spec->proxy_metric = 3; // eroded
+    spec->options = options;
+    spec->base = (struct parameters){
+        0.1,   // inertia // 0 and 1
+        0.001, // min_slope // epsilon and greater than epsilon
+        32,    // capacity // 2 8 16 32 ...
+        0.001, // deposition // 0 1
+        0.1,   // erosion // 0 1
+        9.81,  // gravity //
+        0.002, // evaporation 0 to 0.5
+        4      // radius // 1ugly to 6 10 etc
+    };
+}
+
+void sweep_spec_free(struct sweep_spec *spec)
+{
+    for (int k = 0; k < SWEEP_PARAMETERS; ++k)
+    {
+        free(spec->values[k]);
+        spec->values[k] = NULL;
+        spec->nb_values[k] = 0;
+    }
+    spec->nb_swept = 0;
+}
+
+/**
+ * @brief Removes the blanks around a string, in place.
+ *
+ * @param s The string.
+ * @return char* Start of the trimmed string.
+ */
+static char *trim_blanks(char *s)
+{
+    while (*s == ' ' || *s == '\t')
+        ++s;
+    size_t len = strlen(s);
+    while (len > 0 && (s[len - 1] == ' ' || s[len - 1] == '\t' || s[len - 1] == '\r' || s[len - 1] == '\n'))
+        s[--len] = '\0';
+    return s;
+}
+
+/**
+ * @brief Parses a number taking the whole string.
+ *
+ * @param text The string.
+ * @param value Parsed number.
+ * @return int 0 if successful, -1 if the string is not a number.
+ */
+static int parse_sweep_number(const char *text, double *value)
+{
+    char *end;
+    *value = strtod(text, &end);
+    while (*end == ' ' || *end == '\t')
+        ++end;
+    return end == text || *end != '\0' ? -1 : 0;
+}
+
+/**
+ * @brief Parses a comma-separated list of numbers and ranges: start:stop:step
+ * for a linear range, start:stop:*factor for a geometric one, stop included.
+ *
+ * @param text The list, modified.
+ * @param values Parsed values, allocated, released by the caller.
+ * @param nb_values Number of values.
+ * @return int 0 if successful, -1 if there is an error.
+ */
+static int parse_sweep_values(char *text, double **values, int *nb_values)
+{
+    int capacity = 16;
+    *nb_values = 0;
+    *values = (double *)malloc(capacity * sizeof(double));
+    if (*values == NULL)
+        return -1;
+
+    for (char *item = strtok(text, ","); item != NULL; item = strtok(NULL, ","))
+    {
+        double start, stop = 0, step = 0;
+        int geometric = 0;
+        char *end;
+        item = trim_blanks(item);
+        start = strtod(item, &end);
+        if (end == item)
+            goto error;
+        if (*end == ':')
+        {
+            stop = strtod(end + 1, &end);
+            if (*end != ':')
+                goto error;
+            geometric = end[1] == '*';
+            char *step_text = end + 1 + geometric;
+            if (parse_sweep_number(step_text, &step) != 0)
+                goto error;
+            if (stop < start || (geometric ? step <= 1.0 || start <= 0.0 : step <= 0.0))
+                goto error;
+        }
+        else if (*end != '\0')
+            goto error;
+        else
+            stop = start;
+
+        // stop is included despite the rounding of the steps
+        double tolerance = geometric ? stop * 1e-9 : step * 1e-9;
+        for (int k = 0;; ++k)
+        {
+            double value = geometric ? start * pow(step, k) : start + k * step;
+            if (value > stop + tolerance || (k > 0 && step == 0))
+                break;
+            if (*nb_values == 1000000)
+                goto error;
+            if (*nb_values == capacity)
+            {
+                double *grown = (double *)realloc(*values, 2 * capacity * sizeof(double));
+                if (grown == NULL)
+                    goto error;
+                *values = grown;
+                capacity *= 2;
+            }
+            (*values)[(*nb_values)++] = value;
+        }
+    }
+    if (*nb_values > 0)
+        return 0;
+
+error:
+    free(*values);
+    *values = NULL;
+    return -1;
+}
+
+/**
+ * @brief Orders doubles increasingly.
+ */
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * @brief Parses the drop counts of a sweep, a list as for parse_sweep_values().
+ * The runs go to the largest count; with several counts, the state after
+ * each of them is saved.
+ *
+ * @param spec The specification.
+ * @param text The list, modified.
+ * @return int 0 if successful, -1 if there is an error.
+ */
+static int parse_drop_counts(struct sweep_spec *spec, char *text)
+{
+    double *values;
+    int nb_values;
+    if (parse_sweep_values(text, &values, &nb_values) != 0)
+        return -1;
+    qsort(values, nb_values, sizeof(double), compare_doubles);
+
+    int count = 0;
+    for (int i = 0; i < nb_values; ++i)
+    {
+        if (values[i] < 1 || values[i] > INT_MAX || values[i] != floor(values[i]) || count == SWEEP_DROP_COUNTS)
+        {
+            free(values);
+            return -1;
+        }
+        if (count == 0 || spec->final_drops[count - 1] != (int)values[i])
+            spec->final_drops[count++] = (int)values[i];
+    }
+    free(values);
+    spec->nb_drop = spec->final_drops[count - 1];
+    spec->nb_final_drops = count > 1 ? count : 0;
+    return 0;
+}
+
+int sweep_spec_load(struct sweep_spec *spec, const char *filename)
+{
+    static const char *format_names[] = {"rgb8", "gray8", "gray16", "f64", "f32", "u16"};
+    static const char *profile_names[] = {"archival", "fast", "stored"};
+
+    sweep_spec_default(spec);
+    FILE *f = fopen(filename, "r");
+    if (f == NULL)
+    {
+        printf("Error opening the sweep spec %s: %s\n", filename, strerror(errno));
+        return -1;
+    }
+
+    char line[4096];
+    int line_number = 0;
+    while (fgets(line, sizeof(line), f) != NULL)
+    {
+        ++line_number;
+        char *comment = strchr(line, '#');
+        if (comment != NULL)
+            *comment = '\0';
+        char *key = trim_blanks(line);
+        if (*key == '\0')
+            continue;
+        char *equal = strchr(key, '=');
+        if (equal == NULL)
+        {
+            printf("Error line %d of %s: expected key = value.\n", line_number, filename);
+            goto error;
+        }
+        *equal = '\0';
+        key = trim_blanks(key);
+        char *value = trim_blanks(equal + 1);
 
-                // Normalize weights and apply erosion
-                if (total_weight > 0.0)
+        double number = 0;
+        int is_number = parse_sweep_number(value, &number) == 0;
+        int k, ok = 1;
+        if (strncmp(key, "sweep.", 6) == 0 && (k = sweep_parameter_index(key + 6)) >= 0)
+        {
+            double *values;
+            int nb_values;
+            ok = parse_sweep_values(value, &values, &nb_values) == 0;
+            if (ok)
+            {
+                ok = sweep_spec_set_values(spec, k, values, nb_values) == 0;
+                free(values);
+            }
+        }
+        else if ((k = sweep_parameter_index(key)) >= 0 && is_number)
+            set_sweep_parameter(&spec->base, k, number);
+        else if (strcmp(key, "converge_l1") == 0 && is_number && number >= 0)
+            spec->options.converge_l1 = number;
+        else if (strcmp(key, "converge_linf") == 0 && is_number && number >= 0)
+            spec->options.converge_linf = number;
+        else if (strcmp(key, "proxy_margin") == 0 && is_number && number >= 0)
+            spec->proxy_margin = number;
+        else if (strcmp(key, "proxy_metric") == 0)
+            ok = (spec->proxy_metric = metric_index(value)) >= 0;
+        else if (strcmp(key, "proxy_order") == 0 && (strcmp(value, "highest") == 0 || strcmp(value, "lowest") == 0))
+            spec->proxy_lowest = strcmp(value, "lowest") == 0;
+        else if (strcmp(key, "mode") == 0)
+        {
+            if (strcmp(value, "one_at_a_time") == 0)
+                spec->mode = SWEEP_ONE_AT_A_TIME;
+            else if (strcmp(value, "cartesian") == 0)
+                spec->mode = SWEEP_CARTESIAN;
+            else
+                ok = 0;
+        }
+        else if (strcmp(key, "output") == 0)
+            ok = snprintf(spec->output, sizeof(spec->output), "%s", value) < (int)sizeof(spec->output);
+        else if (strcmp(key, "terrain") == 0)
+            ok = snprintf(spec->terrain, sizeof(spec->terrain), "%s", value) < (int)sizeof(spec->terrain);
+        else if (strcmp(key, "nb_drop") == 0)
+            ok = parse_drop_counts(spec, value) == 0;
+        else if (strcmp(key, "cache") == 0)
+            ok = snprintf(spec->cache, sizeof(spec->cache), "%s", value) < (int)sizeof(spec->cache);
+        else if (strcmp(key, "boss_width") == 0 || strcmp(key, "boss_amplitude") == 0)
+        {
+            vec2 range;
+            ok = sscanf(value, "%lf , %lf", &range.x, &range.y) == 2 && range.x <= range.y;
+            if (strcmp(key, "boss_width") == 0)
+                spec->width_range = range;
+            else
+                spec->amplitude_range = range;
+        }
+        else if (strcmp(key, "format") == 0 || strcmp(key, "profile") == 0)
+        {
+            int is_format = strcmp(key, "format") == 0;
+            const char **names = is_format ? format_names : profile_names;
+            int nb_names = is_format ? 6 : 3;
+            ok = 0;
+            for (int n = 0; n < nb_names; ++n)
+            {
+                if (strcmp(value, names[n]) == 0)
                 {
-                    for (int i = 0; i < size_weights; ++i)
-                    {
-                        if (weights[i].used)
-                        {
-                            float taux_evap = 0.0;
-                            if (drop.position.x > width / 2)
-                            {
-                                taux_evap = 0.8;
-                            }
-                            else
-                            {
-                                taux_evap = 0.1;
-                            }
-                            double quantity = gain * (weights[i].w / total_weight) * 1;
-                            H(*heightmap, width, weights[i].x, weights[i].y) -= quantity;
-                            drop.sediment += quantity;
-                        }
-                    }
+                    if (is_format)
+                        spec->options.format = (enum image_format)n;
+                    else
+                        spec->options.profile = (enum png_profile)n;
+                    ok = 1;
                 }
             }
         }
+        else if (is_number && number >= 0 && number <= INT_MAX && number == floor(number))
+        {
+            if (strcmp(key, "size") == 0)
+                spec->width = spec->height = (int)number;
+            else if (strcmp(key, "bosses") == 0)
+                spec->num_bosses = (int)number;
+            else if (strcmp(key, "scale") == 0)
+                spec->scale = (int)number;
+            else if (strcmp(key, "terrain_seed") == 0)
+                spec->terrain_seed = (unsigned int)number;
+            else if (strcmp(key, "seed") == 0)
+                spec->options.seed = (unsigned int)number;
+            else if (strcmp(key, "warmup") == 0)
+                spec->warmup = (int)number;
+            else if (strcmp(key, "save_every") == 0)
+                spec->save_every = (int)number;
+            else if (strcmp(key, "checkpoint_every") == 0)
+                spec->checkpoint_every = (int)number;
+            else if (strcmp(key, "resume") == 0)
+                spec->resume = number != 0;
+            else if (strcmp(key, "keyframe_interval") == 0)
+                spec->options.keyframe_interval = (int)number;
+            else if (strcmp(key, "animated") == 0)
+                spec->options.animated = number != 0;
+            else if (strcmp(key, "metrics") == 0)
+                spec->metrics = number != 0;
+            else if (strcmp(key, "images") == 0)
+                spec->images = number != 0;
+            else if (strcmp(key, "converge_windows") == 0)
+                spec->options.converge_windows = (int)number;
+            else if (strcmp(key, "processes") == 0)
+                spec->processes = number != 0;
+            else if (strcmp(key, "proxy_factor") == 0)
+                spec->proxy_factor = (int)number;
+            else if (strcmp(key, "top_k") == 0 && number >= 1)
+                spec->top_k = (int)number;
+            else
+                ok = 0;
+        }
+        else
+            ok = 0;
 
-        // 6 - new velocity
-        drop.velocity = sqrt(drop.velocity * drop.velocity + ABS(h_diff) * param.gravity);
+        if (!ok)
+        {
+            printf("Error line %d of %s: invalid %s = %s\n", line_number, filename, key, value);
+            goto error;
+        }
+    }
+    fclose(f);
 
-        // 7 - new water
-        drop.water *= (1.0 - param.evaporation);
+    if (spec->width < 1 || spec->nb_drop < 1 || spec->save_every < 1 || spec->warmup >= spec->nb_drop)
+    {
+        printf("Error in %s: size, nb_drop and save_every must be positive, warmup below nb_drop.\n", filename);
+        sweep_spec_free(spec);
+        return -1;
+    }
+    if (!spec->images && !spec->metrics)
+    {
+        printf("Error in %s: images = 0 needs metrics = 1, the runs would store nothing.\n", filename);
+        sweep_spec_free(spec);
+        return -1;
     }
+    return 0;
+
+error:
+    fclose(f);
+    sweep_spec_free(spec);
+    return -1;
 }
 
 /**
- * @brief Simulates erosion on the terrain with detailed particle drop events.
+ * @brief Counts the runs of a sweep specification, before any selection.
  *
- * @param width Width of the heightmap.
- * @param height Height of the heightmap.
- * @param num_particles Number of particles to simulate.
- * @param heightmap 2D heightmap array.
- * @param capacity Maximum sediment capacity of the terrain.
- * @param inertia Inertia factor of sediment.
- * @param slope Slope factor affecting sediment deposition.
- * @param gravity Gravity force.
- * @param evaporation Evaporation rate of sediment.
+ * @param spec The specification.
+ * @return long Number of runs, -1 if there are more than 1000000.
  */
-void simulate_erosion_detailed(int height, int width, double heightmap[width][height], struct parameters param, int nb_drop, char *path_name, int nb_particule_before_save)
+static long count_sweep_runs(const struct sweep_spec *spec)
 {
-    random_init();
-    struct drop drop;
-    char name[50];
-    char string_i[50];
-    for (int i = 1; i <= nb_drop; ++i)
+    long total = spec->nb_swept > 0 && spec->mode == SWEEP_ONE_AT_A_TIME ? 0 : 1;
+    for (int s = 0; s < spec->nb_swept; ++s)
     {
-        if (i % nb_particule_before_save == 0)
+        int nb_values = spec->nb_values[spec->order[s]];
+        total = spec->mode == SWEEP_CARTESIAN ? total * nb_values : total + nb_values;
+        if (total > 1000000)
         {
-            name[0] = '\0';
-            string_i[0] = '\0';
-            strcat(name, path_name);
-            sprintf(string_i, "%d", i);
-            strcat(name, string_i);
-            strcat(name, ".png");
-            // printf("%s\n", name);
-            save_heightmap_as_image(width, height, heightmap, name);
+            printf("Error: the sweep has more than 1000000 runs.\n");
+            return -1;
         }
-        drop.position = random_vec2(width, height);
-        drop.direction.x = 0.0;
-        drop.direction.y = 0.0;
-        drop.velocity = 1.0;
-        drop.water = 1.0;
-        drop.sediment = 0.0;
-        drop.lifetime = 1000;
-        simulate_drop(height, width, heightmap, drop, param); // Directly modify heightmap here
     }
+    return total;
 }
 
 /**
- * Simulates erosion on a given heightmap using specified parameters and a given number of erosion drops.
+ * @brief Expands a sweep specification into its runs.
  *
- * @param height Height of the terrain grid.
- * @param width Width of the terrain grid.
- * @param heightmap 2D array representing the height values.
- * @param param Structure containing erosion parameters.
- * @param nb_drop Number of erosion drops to apply.
- */
-void simulate_erosion(int height, int width, double heightmap[width][height], struct parameters param, int nb_drop)
-{
-    char *e = "";
-    simulate_erosion_detailed(height, width, heightmap, param, nb_drop, e, nb_drop);
-}
-
-/**
- * Generates a heightmap with Gaussian boss peaks.
+ * One parameter at a time gives a run per swept value, in dir/name_i/name;
+ * the cartesian product gives a run per combination, the last swept
+ * parameter varying fastest, in dir/run_i/run. Nothing swept gives one run
+ * with the base parameters. With a selection, only the selected runs are
+ * kept, numbered in order; their paths keep their index in the full sweep.
  *
- * @param width Width of the heightmap.
- * @param height Height of the heightmap.
- * @param heightmap 2D array representing the terrain heightmap.
- * @param num_bosses Number of Gaussian boss peaks to generate.
- * @param scale Scale factor to apply to the generated height values.
- * @param width_range Min and max width of the boss peaks.
- * @param amplitude_range Min and max amplitude of the boss peaks.
+ * @param spec The specification.
+ * @param nb_jobs Number of runs.
+ * @return struct sweep_job* Runs of the sweep, allocated, NULL if there is an error.
  */
-void generate_random_heightgaussian(int width, int height, double heightmap[width][height], int num_bosses, int scale, vec2 width_range, vec2 amplitude_range)
+static struct sweep_job *expand_sweep_spec(const struct sweep_spec *spec, int *nb_jobs)
 {
-    random_init();
-    // set heightmap to 0
-    for (int x = 0; x < height; ++x)
+    long total = count_sweep_runs(spec);
+    if (total < 0)
+        return NULL;
+
+    struct sweep_job *jobs = (struct sweep_job *)malloc(total * sizeof(struct sweep_job));
+    if (jobs == NULL)
     {
-        for (int y = 0; y < width; ++y)
+        printf("Memory allocation error for %ld sweep runs.\n", total);
+        return NULL;
+    }
+
+    *nb_jobs = 0;
+    if (spec->mode == SWEEP_ONE_AT_A_TIME && spec->nb_swept > 0)
+    {
+        long e = 0;
+        for (int s = 0; s < spec->nb_swept; ++s)
         {
-            heightmap[x][y] = 0;
+            int k = spec->order[s];
+            for (int i = 0; i < spec->nb_values[k]; ++i)
+            {
+                if (spec->selected != NULL && !spec->selected[e++])
+                    continue;
+                struct parameters p = spec->base;
+                set_sweep_parameter(&p, k, spec->values[k][i]);
+                add_sweep_job(jobs, nb_jobs, spec->output, sweep_parameter_names[k], i, p);
+            }
         }
+        return jobs;
     }
-    // add num_bosses bosses
-    vec2 center;
-    for (int i = 0; i < num_bosses; ++i)
+
+    for (long j = 0; j < total; ++j)
     {
-        // position random
-        center = random_vec2(width, height);
+        if (spec->selected != NULL && !spec->selected[j])
+            continue;
+        struct parameters p = spec->base;
+        char values[512] = "";
+        int digits[SWEEP_PARAMETERS];
+        long index = j;
+        for (int s = spec->nb_swept - 1; s >= 0; --s)
+        {
+            digits[s] = index % spec->nb_values[spec->order[s]];
+            index /= spec->nb_values[spec->order[s]];
+        }
+        for (int s = 0; s < spec->nb_swept; ++s)
+        {
+            int k = spec->order[s];
+            double value = spec->values[k][digits[s]];
+            set_sweep_parameter(&p, k, value);
+            size_t len = strlen(values);
+            snprintf(values + len, sizeof(values) - len, " %s=%g", sweep_parameter_names[k], value);
+        }
+        add_sweep_job(jobs, nb_jobs, spec->output, "run", (int)j, p);
+        if (spec->nb_swept > 0)
+            printf("   %s\n", values);
+    }
+    return jobs;
+}
 
-        // random width_range
-        // width_range.x is min width and width_range.y is max
-        double gaussian_width = random_double_min_max(rand(), width_range.x, width_range.y);
+int run_sweep_spec(const struct sweep_spec *spec)
+{
+    if (spec->proxy_factor > 1)
+        return run_adaptive_sweep(spec);
 
-        // random amplitud
-        double amplitude = random_double_min_max(rand(), amplitude_range.x, amplitude_range.y);
+    int width = spec->width;
+    int height = spec->height;
+    struct heightmap_file terrain = {0};
+    double *original = NULL;
+    char name[1100];
 
-        // for each position of the heightmap
-        // compute it's value
-        double distance;
-        for (int x = 0; x < height; ++x)
+    random_init();
+    if (spec->terrain[0] != '\0')
+    {
+        if (load_heightmap(spec->terrain, 0, 0, &terrain) != 0)
+            return -1;
+        if (terrain.width != terrain.height)
         {
-            for (int y = 0; y < width; ++y)
-            {
-                // gaussian
-                distance = sqrt((x - center.x) * (x - center.x) + (y - center.y) * (y - center.y));
-                heightmap[x][y] += exp2(-(distance * distance) / (2 * gaussian_width * gaussian_width)) * amplitude;
-            }
+            printf("Error: the terrain %s is %d x %d, sweeps need a square heightmap.\n", spec->terrain, terrain.width, terrain.height);
+            unload_heightmap(&terrain);
+            return -1;
         }
+        width = terrain.width;
+        height = terrain.height;
+        original = terrain.data;
     }
 
-    // scale and find min & max
-    double min = heightmap[0][0] * scale; // min float;
-    double max = heightmap[0][0] * scale; // max float;
-    for (int x = 0; x < height; ++x)
+    int nb_jobs = 0;
+    struct sweep_job *jobs = expand_sweep_spec(spec, &nb_jobs);
+    uint64_t *keys = jobs != NULL ? (uint64_t *)malloc(MAX(nb_jobs, 1) * sizeof(uint64_t)) : NULL;
+    if (keys == NULL)
     {
-        for (int y = 0; y < width; ++y)
+        free(jobs);
+        if (terrain.data != NULL)
+            unload_heightmap(&terrain);
+        return -1;
+    }
+    // the warm-up and the final drop counts change the outputs of every run
+    uint64_t variant = spec->warmup > 0 ? sweep_run_key(&spec->base, spec->warmup, 0) : 0;
+    variant = fnv1a64(variant, spec->final_drops, spec->nb_final_drops * sizeof(int));
+    if (spec->options.converge_windows > 0)
+    {
+        variant = fnv1a64(variant, &spec->options.converge_windows, sizeof(int));
+        variant = fnv1a64(variant, &spec->options.converge_l1, sizeof(double));
+        variant = fnv1a64(variant, &spec->options.converge_linf, sizeof(double));
+    }
+    for (int j = 0; j < nb_jobs; ++j)
+        keys[j] = sweep_run_key(&jobs[j].param, spec->nb_drop, spec->save_every) ^ variant;
+
+    // a generated terrain is only resumable through its saved copy
+    struct run_options options = spec->options;
+    struct sweep_journal journal;
+    char terrain_copy[1100];
+    snprintf(terrain_copy, sizeof(terrain_copy), "%s/original.hmap", spec->output);
+    int resume = spec->resume && (original != NULL || access(terrain_copy, R_OK) == 0);
+    int resumed = create_directories(spec->output) == 0 ? journal_open(&journal, spec->output, width, height, nb_jobs, keys, spec->checkpoint_every, resume, &options.seed) : -1;
+    if (resumed >= 0)
+        options.journal = &journal;
+    else if (options.seed == 0)
+        options.seed = MAX((unsigned int)rand(), 1u); // 0 would draw a seed per run
+    free(keys);
+
+    if (original == NULL && resumed == 1 && load_heightmap(terrain_copy, 0, 0, &terrain) == 0)
+    {
+        if (terrain.width == width && terrain.height == height)
+            original = terrain.data;
+        else
+            unload_heightmap(&terrain);
+    }
+    if (original == NULL)
+    {
+        if (resumed == 1)
         {
-            heightmap[x][y] *= scale;
-            if (heightmap[x][y] > max)
-                max = heightmap[x][y];
-            if (heightmap[x][y] < min)
-                min = heightmap[x][y];
+            printf("Error: the terrain of the sweep to resume, %s, cannot be read.\n", terrain_copy);
+            journal_close(&journal);
+            free(jobs);
+            return -1;
+        }
+        original = (double *)malloc((size_t)width * height * sizeof(double));
+        if (original == NULL)
+        {
+            printf("Memory allocation error for the sweep terrain.\n");
+            if (options.journal != NULL)
+                journal_close(&journal);
+            free(jobs);
+            return -1;
         }
+        unsigned int terrain_seed = spec->terrain_seed != 0 ? spec->terrain_seed : (unsigned int)rand(); // 0 asks for a time-based terrain
+        generate_random_heightgaussian(width, height, (double(*)[height])original, spec->num_bosses, spec->scale, spec->width_range, spec->amplitude_range, terrain_seed);
+        struct run_options raw = {.format = RAW_F64, .profile = PNG_ARCHIVAL};
+        save_heightmap_as_image(width, height, (double(*)[height])original, terrain_copy, &raw);
     }
 
-    // normalize to 0 - 255
-    for (int x = 0; x < height; ++x)
+    snprintf(name, sizeof(name), "%s/original.png", spec->output);
+    save_heightmap_as_image(width, height, (double(*)[height])original, name, NULL);
+
+    // the warm-up is deterministic: a resumed sweep simulates it again
+    double *start_state = original;
+    int first_drop = 0;
+    if (spec->warmup > 0)
     {
-        for (int y = 0; y < width; ++y)
+        start_state = (double *)malloc((size_t)width * height * sizeof(double));
+        if (start_state == NULL)
+            start_state = original;
+        else
         {
-            heightmap[x][y] -= min;
-            heightmap[x][y] /= (max - min);
-            heightmap[x][y] *= 255.0;
+            struct run_options warmup = RUN_OPTIONS_DEFAULT;
+            warmup.seed = options.seed;
+            memcpy(start_state, original, (size_t)width * height * sizeof(double));
+            simulate_erosion_detailed(height, width, (double(*)[height])start_state, spec->base, spec->warmup, "", spec->warmup + 1, &warmup);
+            first_drop = spec->warmup + 1;
+            printf("Warm-up of %d drops shared by %d runs\n", spec->warmup, nb_jobs);
         }
     }
+    // forked runs erode the start state in place: the original stays the metrics reference
+    if (spec->processes && spec->metrics && start_state == original)
+    {
+        start_state = (double *)malloc((size_t)width * height * sizeof(double));
+        if (start_state == NULL)
+            start_state = original;
+        else
+            memcpy(start_state, original, (size_t)width * height * sizeof(double));
+    }
+    options.final_drops = spec->nb_final_drops > 0 ? spec->final_drops : NULL;
+    options.nb_final_drops = spec->nb_final_drops;
+    options.metrics_only = !spec->images;
+
+    // measured against the terrain before the warm-up, the whole erosion counted
+    struct metrics_log metrics;
+    snprintf(name, sizeof(name), "%s/metrics.csv", spec->output);
+    if (spec->metrics && metrics_open(&metrics, name, original, width, height, resumed == 1) == 0)
+        options.metrics = &metrics;
+
+    // identical runs are simulated once, their outputs linked afterwards
+    uint64_t terrain_hash = fnv1a64(0xcbf29ce484222325ull, start_state, (size_t)width * height * sizeof(double));
+    for (int j = 0; j < nb_jobs; ++j)
+        jobs[j].key = sweep_cache_key(terrain_hash, first_drop, &jobs[j].param, spec->nb_drop, spec->save_every, &options);
+    int nb_duplicates = mark_duplicate_runs(jobs, nb_jobs);
+
+    // every snapshot of every run goes in one archive, indexed by run id and drop count
+    struct frame_archive archive;
+    snprintf(name, sizeof(name), "%s/sweep.harc", spec->output);
+    if (!options.metrics_only && create_directories(spec->output) == 0 && archive_open(&archive, name, width, height, &options) == 0)
+        options.archive = &archive;
+
+    // the cache only holds frames: runs with finals or metrics are simulated
+    int cached = spec->cache[0] != '\0' && spec->nb_final_drops == 0 && options.metrics == NULL;
+    struct sweep_pool pool = {.original = start_state, .width = width, .height = height, .nb_drop = spec->nb_drop,
+                              .modulo_save_image = spec->save_every, .options = options, .jobs = jobs, .nb_jobs = nb_jobs,
+                              .cache = cached ? spec->cache : NULL, .first_drop = first_drop};
+    double start = get_time();
+    int nb_threads = spec->processes ? run_sweep_processes(&pool) : run_sweep(&pool);
+    if (spec->processes && options.metrics != NULL)
+    {
+        // the rows of the children are only in the file
+        metrics_close(&metrics);
+        snprintf(name, sizeof(name), "%s/metrics.csv", spec->output);
+        if (metrics_open(&metrics, name, original, width, height, 1) != 0)
+            pool.options.metrics = options.metrics = NULL;
+    }
+    for (int j = 0; j < nb_jobs; ++j)
+    {
+        // the duplicates of a failed run are linked when the sweep is resumed
+        if (jobs[j].duplicate_of >= 0 && (options.journal == NULL || journal.done[jobs[j].duplicate_of]))
+            link_duplicate_run(&pool, j);
+    }
+    printf("Sweep of %d runs (%d duplicates) on %d threads: %.1f s\n", nb_jobs, MAX(nb_duplicates, 0), nb_threads, get_time() - start);
+
+    if (options.archive != NULL)
+        archive_close(&archive);
+    if (options.metrics != NULL)
+        metrics_close(&metrics);
+    if (options.journal != NULL)
+        journal_close(&journal);
+    free(jobs);
+    if (start_state != original)
+        free(start_state);
+    if (terrain.data != NULL)
+        unload_heightmap(&terrain);
+    else
+        free(original);
+    return 0;
 }
 
 /**
- * Copies the heightmap from the source to the destination.
+ * @brief Downsamples a square heightmap by averaging blocks of factor x factor
+ * cells. Heights are divided by the factor too, so the slopes between cells
+ * are those of the full terrain.
  *
- * @param w Width of the heightmap.
- * @param h Height of the heightmap.
- * @param dest Destination 2D array for the copied heightmap.
- * @param src Source 2D array to copy from.
+ * @param width Width of the full heightmap.
+ * @param src Full heightmap, row-major.
+ * @param factor Side of the blocks.
+ * @param dst Downsampled heightmap, (width / factor)^2 values.
  */
-void copy_heightmap(int w, int h, double dest[w][h], double src[w][h])
+static void downsample_heightmap(int width, const double *src, int factor, double *dst)
 {
-    for (int i = 0; i < w; ++i)
+    int small = width / factor;
+    double norm = 1.0 / ((double)factor * factor * factor);
+    for (int y = 0; y < small; ++y)
     {
-        for (int j = 0; j < h; ++j)
+        for (int x = 0; x < small; ++x)
         {
-            dest[i][j] = src[i][j];
+            double sum = 0.0;
+            for (int dy = 0; dy < factor; ++dy)
+            {
+                const double *row = src + (size_t)(y * factor + dy) * width + x * factor;
+                for (int dx = 0; dx < factor; ++dx)
+                    sum += row[dx];
+            }
+            dst[(size_t)y * small + x] = sum * norm;
         }
     }
 }
 
+struct proxy_score {
+    double key; /**< Score, negated when the lowest are kept: larger is better. */
+    int run;    /**< Index of the run in the full sweep. */
+};
+
 /**
- * Generates a directory name by appending an index to the base directory name.
- *
- * @param dest The destination string to store the generated directory name.
- * @param i Index to append to the directory name.
- * @param name Base directory name.
+ * @brief Orders proxy scores from the best, then by run.
  */
-void name_directory(char *dest, int i, char *name)
+static int compare_proxy_scores(const void *a, const void *b)
 {
-    char dec[4];
-    sprintf(dec, "_%d/", i);
-    strcat(dest, dec);
-    strcat(dest, name);
+    const struct proxy_score *x = (const struct proxy_score *)a;
+    const struct proxy_score *y = (const struct proxy_score *)b;
+    if (x->key != y->key)
+        return x->key > y->key ? -1 : 1;
+    return x->run - y->run;
 }
 
-/**
- * Conducts erosion simulations with varying parameters, storing results in separate directories.
- *
- * @param dir_path Base directory path to store results.
- * @param width Width of the heightmap.
- * @param height Height of the heightmap.
- * @param num_bosses Number of Gaussian boss peaks to generate.
- * @param scale Scale factor for heightmap values.
- * @param width_range Range for boss peak widths (min, max).
- * @param amplitude_range Range for boss peak amplitudes (min, max).
- */
-void erosion_simulation_with_param_variations(char *dir_path, int width, int height, int num_bosses, int scale, vec2 width_range, vec2 amplitude_range)
+int run_adaptive_sweep(const struct sweep_spec *spec)
 {
-    random_init();
-
-    double heightmap[width][height];
-    double original[width][height];
-    generate_random_heightgaussian(width, height, original, num_bosses, scale, width_range, amplitude_range);
-
-    save_heightmap_as_image(width, height, original, "image/original.png");
-
-    struct parameters p = {
-        0.1,   // inertia // 0 and 1
-        0.001, // min_slope // epsilon and greater than epsilon
-        32,    // capacity // 2 8 16 32 ...
-        0.001, // deposition // 0 1
-        0.1,   // erosion // 0 1
-        9.81,  // gravity //
-        0.002, // evaporation 0 to 0.5
-        4      // radius // 1ugly to 6 10 etc
-    };
-
-    // inertia
-    char path[1024];
-    double param_inertia[] = {0.001, 0.01, 0.1, 0.5};
-    int modulo_save_image = 1000;
-    int nb_drop = 100000;
+    int factor = spec->proxy_factor;
+    int width = spec->width;
+    struct heightmap_file terrain = {0};
+    double *original = NULL, *proxy = NULL, *radius = NULL;
+    struct proxy_score *scores = NULL;
+    unsigned char *selected = NULL;
+    char terrain_copy[1100], proxy_terrain[1100], name[1100];
+    struct run_options raw = {.format = RAW_F64, .profile = PNG_ARCHIVAL};
+    int status = -1;
 
-    for (int i = 0; i < 4; ++i)
+    // both passes erode the same terrain: a generated one is saved first
+    snprintf(terrain_copy, sizeof(terrain_copy), "%s/original.hmap", spec->output);
+    const char *source = spec->terrain[0] != '\0' ? spec->terrain : spec->resume && access(terrain_copy, R_OK) == 0 ? terrain_copy : NULL;
+    if (source != NULL)
     {
-        // edit inertia
-        strcpy(path, dir_path);
-        strcat(path, "/inertia");
-        name_directory(path, i, "inertia");
-        copy_heightmap(width, height, heightmap, original);
-        p.inertia = param_inertia[i];
-        simulate_erosion_detailed(height, width, heightmap, p, nb_drop, path, modulo_save_image);
+        if (load_heightmap(source, 0, 0, &terrain) != 0)
+            return -1;
+        if (terrain.width != terrain.height)
+        {
+            printf("Error: the terrain %s is %d x %d, sweeps need a square heightmap.\n", source, terrain.width, terrain.height);
+            goto cleanup;
+        }
+        width = terrain.width;
+        original = terrain.data;
     }
-    p.inertia = 0.1;
-
-    // min_slope
-    strcpy(path, dir_path);
-    strcat(path, "/slope/slope");
-    double param_slope[] = {0.001, 0.01, 0.1};
-    for (int i = 0; i < 3; ++i)
+    else
     {
-        // edit min slope
-        strcpy(path, dir_path);
-        strcat(path, "/slope");
-        name_directory(path, i, "slope");
-        copy_heightmap(width, height, heightmap, original);
-        p.slope = param_slope[i];
-        simulate_erosion_detailed(height, width, heightmap, p, nb_drop, path, modulo_save_image);
+        random_init();
+        original = (double *)malloc((size_t)width * width * sizeof(double));
+        if (original == NULL || create_directories(spec->output) != 0)
+        {
+            printf("Error preparing the terrain of the adaptive sweep in %s.\n", spec->output);
+            goto cleanup;
+        }
+        unsigned int terrain_seed = spec->terrain_seed != 0 ? spec->terrain_seed : (unsigned int)rand(); // 0 asks for a time-based terrain
+        generate_random_heightgaussian(width, width, (double(*)[width])original, spec->num_bosses, spec->scale, spec->width_range, spec->amplitude_range, terrain_seed);
+        save_heightmap_as_image(width, width, (double(*)[width])original, terrain_copy, &raw);
+        source = terrain_copy;
     }
-    p.slope = 0.001;
 
-    // capacity
-    strcpy(path, dir_path);
-    strcat(path, "/capacity/capacity");
-    double param_capacity[] = {4, 6, 32};
-    for (int i = 0; i < 3; ++i)
+    int small = width / factor;
+    if (small < 8)
     {
-        // edit capacity
-        strcpy(path, dir_path);
-        strcat(path, "/capacity");
-        name_directory(path, i, "capacity");
-        copy_heightmap(width, height, heightmap, original);
-        p.capacity = param_capacity[i];
-        simulate_erosion_detailed(height, width, heightmap, p, nb_drop, path, modulo_save_image);
+        printf("Error: a proxy factor of %d leaves a %d x %d terrain.\n", factor, small, small);
+        goto cleanup;
     }
-    p.capacity = 32;
-
-    // deposition
-    strcpy(path, dir_path);
-    strcat(path, "/deposition/deposition");
-    double param_deposition[] = {0.001, 0.01, 0.1, 0.5};
-    for (int i = 0; i < 4; ++i)
+    proxy = (double *)malloc((size_t)small * small * sizeof(double));
+    if (proxy == NULL)
     {
-        // edit deposition
-        strcpy(path, dir_path);
-        strcat(path, "/deposition");
-        name_directory(path, i, "deposition");
-        copy_heightmap(width, height, heightmap, original);
-        p.deposition = param_deposition[i];
-        simulate_erosion_detailed(height, width, heightmap, p, nb_drop, path, modulo_save_image);
+        printf("Memory allocation error for the proxy terrain.\n");
+        goto cleanup;
     }
-    p.deposition = 0.001;
+    downsample_heightmap(width, original, factor, proxy);
+    snprintf(proxy_terrain, sizeof(proxy_terrain), "%s/proxy/terrain.hmap", spec->output);
+    save_heightmap_as_image(small, small, (double(*)[small])proxy, proxy_terrain, &raw);
 
-    // erosion
-    strcpy(path, dir_path);
-    strcat(path, "/erosion/erosion");
-    double param_erosion[] = {0.001, 0.01, 0.1, 0.5};
-    for (int i = 0; i < 4; ++i)
+    // same drops per cell, same radius in cells of the full terrain
+    struct sweep_spec proxy_spec = *spec;
+    long cells = (long)factor * factor;
+    proxy_spec.proxy_factor = 0;
+    proxy_spec.selected = NULL;
+    if (snprintf(proxy_spec.output, sizeof(proxy_spec.output), "%s/proxy", spec->output) >= (int)sizeof(proxy_spec.output) ||
+        snprintf(proxy_spec.terrain, sizeof(proxy_spec.terrain), "%s", proxy_terrain) >= (int)sizeof(proxy_spec.terrain))
     {
-        // edit erosion
-        strcpy(path, dir_path);
-        strcat(path, "/erosion");
-        name_directory(path, i, "erosion");
-        copy_heightmap(width, height, heightmap, original);
-        p.erosion = param_erosion[i];
-        simulate_erosion_detailed(height, width, heightmap, p, nb_drop, path, modulo_save_image);
+        printf("Error: the output path %s is too long.\n", spec->output);
+        goto cleanup;
+    }
+    proxy_spec.width = proxy_spec.height = small;
+    proxy_spec.nb_drop = (int)MAX(spec->nb_drop / cells, 2);
+    proxy_spec.nb_final_drops = 0;
+    proxy_spec.save_every = (int)MAX(spec->save_every / cells, 1);
+    proxy_spec.checkpoint_every = (int)(spec->checkpoint_every / cells);
+    proxy_spec.warmup = (int)MIN(spec->warmup / cells, proxy_spec.nb_drop - 1);
+    proxy_spec.metrics = 1;
+    proxy_spec.images = 0;
+    proxy_spec.cache[0] = '\0';
+    proxy_spec.options.converge_windows = 0; // every run ranked at the same drop count
+    proxy_spec.base.radius = (int)MAX(lround((double)spec->base.radius / factor), 1);
+    if (spec->values[7] != NULL)
+    {
+        radius = (double *)malloc(spec->nb_values[7] * sizeof(double));
+        if (radius == NULL)
+        {
+            printf("Memory allocation error for the proxy radius values.\n");
+            goto cleanup;
+        }
+        for (int i = 0; i < spec->nb_values[7]; ++i)
+            radius[i] = MAX(spec->values[7][i] / factor, 1.0);
+        proxy_spec.values[7] = radius;
     }
-    p.erosion = 0.1;
+    printf("Proxy sweep: %d x %d terrain, %d drops per run\n", small, small, proxy_spec.nb_drop);
+    if (run_sweep_spec(&proxy_spec) != 0)
+        goto cleanup;
 
-    // gravity
-    strcpy(path, dir_path);
-    strcat(path, "/gravity/gravity");
-    double param_gravity[] = {9.81, 1.0};
-    for (int i = 0; i < 2; ++i)
+    // score of a run: its last snapshot; the runs without one are kept
+    long nb_runs = count_sweep_runs(spec);
+    struct metrics_log log;
+    snprintf(name, sizeof(name), "%s/proxy/metrics.csv", spec->output);
+    scores = nb_runs > 0 ? (struct proxy_score *)malloc(nb_runs * sizeof(struct proxy_score)) : NULL;
+    selected = nb_runs > 0 ? (unsigned char *)calloc(nb_runs, 1) : NULL;
+    int *last_drop = nb_runs > 0 ? (int *)malloc(nb_runs * sizeof(int)) : NULL;
+    if (scores == NULL || selected == NULL || last_drop == NULL || metrics_open(&log, name, proxy, small, small, 1) != 0)
+    {
+        printf("Error reading the scores of the proxy sweep.\n");
+        free(last_drop);
+        goto cleanup;
+    }
+    for (long j = 0; j < nb_runs; ++j)
+        last_drop[j] = -1;
+    for (int r = 0; r < log.count; ++r)
     {
-        // edit gravity
-        strcpy(path, dir_path);
-        strcat(path, "/gravity");
-        name_directory(path, i, "gravity");
-        copy_heightmap(width, height, heightmap, original);
-        p.gravity = param_gravity[i];
-        simulate_erosion_detailed(height, width, heightmap, p, nb_drop, path, modulo_save_image);
+        const struct metrics_row *row = &log.rows[r];
+        long j = row->run_id - 1;
+        if (j >= 0 && j < nb_runs && row->nb_drop >= last_drop[j])
+        {
+            last_drop[j] = row->nb_drop;
+            double value = metric_value(&row->metrics, spec->proxy_metric);
+            scores[j].key = spec->proxy_lowest ? -value : value;
+        }
     }
-    p.gravity = 9.81;
+    metrics_close(&log);
 
-    // evaporation
-    strcpy(path, dir_path);
-    strcat(path, "/evaporation/evaporation");
-    double param_evaporation[] = {0.001, 0.01, 0.1, 0.2, 0.5};
-    for (int i = 0; i < 5; ++i)
+    int nb_scored = 0, nb_kept = 0;
+    for (long j = 0; j < nb_runs; ++j)
+    {
+        if (last_drop[j] < 0)
+            selected[j] = 1;
+        else
+            scores[nb_scored++] = (struct proxy_score){scores[j].key, (int)j};
+    }
+    free(last_drop);
+    qsort(scores, nb_scored, sizeof(struct proxy_score), compare_proxy_scores);
+    for (int r = 0; r < nb_scored; ++r)
     {
-        // edit inertia
-        strcpy(path, dir_path);
-        strcat(path, "/evaporation");
-        name_directory(path, i, "evaporation");
-        copy_heightmap(width, height, heightmap, original);
-        p.evaporation = param_evaporation[i];
-        simulate_erosion_detailed(height, width, heightmap, p, nb_drop, path, modulo_save_image);
+        // the runs close to the cut are too uncertain to drop
+        double cut = scores[MIN(spec->top_k, nb_scored) - 1].key;
+        int keep = r < spec->top_k || scores[r].key >= cut - spec->proxy_margin * fabs(cut);
+        selected[scores[r].run] = keep;
+        printf("Proxy rank %d: run %d, %s = %g%s\n", r + 1, scores[r].run + 1, metric_names[spec->proxy_metric],
+               spec->proxy_lowest ? -scores[r].key : scores[r].key, keep ? ", kept" : "");
     }
-    p.evaporation = 0.002;
+    for (long j = 0; j < nb_runs; ++j)
+        nb_kept += selected[j];
+    printf("Adaptive sweep: %d of %ld runs at full resolution\n", nb_kept, nb_runs);
+
+    struct sweep_spec full_spec = *spec;
+    full_spec.proxy_factor = 0;
+    full_spec.selected = selected;
+    if (snprintf(full_spec.terrain, sizeof(full_spec.terrain), "%s", source) < (int)sizeof(full_spec.terrain))
+        status = run_sweep_spec(&full_spec);
+
+cleanup:
+    free(scores);
+    free(selected);
+    free(radius);
+    free(proxy);
+    if (terrain.data != NULL)
+        unload_heightmap(&terrain);
+    else
+        free(original);
+    return status;
+}
+
+/**
+ * Conducts erosion simulations with varying parameters. The snapshots of all
+ * runs are stored in dir_path/sweep.harc, run ids numbered from 1 in the order
+ * printed; the per-run directories are only used if the archive cannot be opened.
+ *
+ * The runs are independent and execute concurrently, one per processor. All
+ * of them drop the same sequence of drops (same seed, hashed per drop), so
+ * their differences only come from the parameters, whatever the scheduling.
+ *
+ * @param dir_path Base directory path to store results.
+ * @param width Width of the heightmap.
+ * @param height Height of the heightmap.
+ * @param num_bosses Number of Gaussian boss peaks to generate.
+ * @param scale Scale factor for heightmap values.
+ * @param width_range Range for boss peak widths (min, max).
+ * @param amplitude_range Range for boss peak amplitudes (min, max).
+ * @param terrain_seed Seed of the generated terrain, 0 for a time-based one.
+ */
+void erosion_simulation_with_param_variations(char *dir_path, int width, int height, int num_bosses, int scale, vec2 width_range, vec2 amplitude_range, unsigned int terrain_seed)
+{
+    struct sweep_spec spec;
+    sweep_spec_default(&spec);
+    snprintf(spec.output, sizeof(spec.output), "%s", dir_path);
+    spec.width = width;
+    spec.height = height;
+    spec.num_bosses = num_bosses;
+    spec.scale = scale;
+    spec.width_range = width_range;
+    spec.amplitude_range = amplitude_range;
+    spec.terrain_seed = terrain_seed;
 
-    // radius
-    strcpy(path, dir_path);
-    strcat(path, "/radius/radius");
+    double param_inertia[] = {0.001, 0.01, 0.1, 0.5};
+    double param_slope[] = {0.001, 0.01, 0.1};
+    double param_capacity[] = {4, 6, 32};
+    double param_deposition[] = {0.001, 0.01, 0.1, 0.5};
+    double param_erosion[] = {0.001, 0.01, 0.1, 0.5};
+    double param_gravity[] = {9.81, 1.0};
+    double param_evaporation[] = {0.001, 0.01, 0.1, 0.2, 0.5};
     double param_radius[] = {1, 2, 4, 8};
-    for (int i = 0; i < 4; ++i)
-    {
-        // edit radius
-        strcpy(path, dir_path);
-        strcat(path, "/radius");
-        name_directory(path, i, "radius");
-        copy_heightmap(width, height, heightmap, original);
-        p.radius = param_radius[i];
-        simulate_erosion_detailed(height, width, heightmap, p, nb_drop, path, modulo_save_image);
-    }
-    p.radius = 4;
-}
\ No newline at end of file
+    const double *values[SWEEP_PARAMETERS] = {param_inertia, param_slope, param_capacity, param_deposition,
+                                              param_erosion, param_gravity, param_evaporation, param_radius};
+    int nb_values[SWEEP_PARAMETERS] = {4, 3, 3, 4, 4, 2, 5, 4};
+
+    for (int k = 0; k < SWEEP_PARAMETERS; ++k)
+    {
+        if (sweep_spec_set_values(&spec, k, values[k], nb_values[k]) != 0)
+        {
+            sweep_spec_free(&spec);
+            return;
+        }
+    }
+    run_sweep_spec(&spec);
+    sweep_spec_free(&spec);
+}